@@ -0,0 +1,120 @@
+//benchmarks for the editor, built together with it by make bench: the
+//editor's source is included whole, without its main
+#define LITE_NO_MAIN
+#include "texteditor.c"
+
+
+/*** benchmarks ***/
+//the keyword scan the lexer used before keyword tables were compiled,
+//kept as the baseline for --bench-highlight
+int editorKeywordAtLinear(struct editorSyntax *syn, const char *s,
+                          unsigned char *hl) {
+  char **keywords = syn->keywords;
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    if (!strncmp(s, keywords[j], klen) && is_separator(s[klen])) {
+      *hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      return klen;
+    }
+  }
+  return 0;
+}
+
+//best time of a few full highlighting passes over every row
+double editorBenchHighlightPass() {
+  double best = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    double start = editorNowMs();
+    rowiter it;
+    erow *row;
+    int in = 0;
+    for (row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+      editorUpdateSyntax(row, in);
+      in = row->hl_open;
+    }
+    double ms = editorNowMs() - start;
+    if (pass == 0 || ms < best) best = ms;
+  }
+  return best;
+}
+
+//--bench-highlight FILE: highlighting throughput with the compiled keyword
+//table against the linear keyword scan, files of any type are lexed as C
+int editorBenchHighlight(char *filename) {
+  editorOpen(filename);
+  if (E.syntax == NULL) E.syntax = &HLDB[0];
+  double bytes = 0;
+  rowiter it;
+  erow *row;
+  for (row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    editorRowRender(row);
+    bytes += row->rsize;
+  }
+  double mb = bytes / 1e6;
+  editorKeywordMatch = editorKeywordAtLinear;
+  double linear = editorBenchHighlightPass();
+  editorKeywordMatch = editorKeywordAt;
+  double hashed = editorBenchHighlightPass();
+  printf("%s: %d lines, %.1f MB rendered\n", filename, E.numrows, mb);
+  printf("linear keyword scan: %8.1f ms %8.1f MB/s\n", linear, mb / (linear / 1000));
+  printf("perfect hash:        %8.1f ms %8.1f MB/s (%.2fx)\n", hashed,
+    mb / (hashed / 1000), linear / hashed);
+  return 0;
+}
+
+//average build time and size of frames while stepping the cursor n
+//times by (dy, dx), repainting whole frames when full is set
+void editorBenchRenderRun(const char *name, int n, int dy, int dx, int full) {
+  E.cursor_y = E.cursor_x = E.rowoffset = E.coloffset = 0;
+  E.screen.valid = 0;
+  editorBuildFrame();
+  double ms = 0;
+  long bytes = 0;
+  for (int i = 0; i < n; i++) {
+    E.cursor_y = (E.cursor_y + dy) % (E.numrows ? E.numrows : 1);
+    E.cursor_x += dx;
+    erow *row = editorRowAt(E.cursor_y);
+    if (E.cursor_x > (row ? row->size : 0)) E.cursor_x = 0;
+    if (full) E.screen.valid = 0;
+    editorBuildFrame();
+    ms += E.screen.build_ms;
+    bytes += E.screen.bytes;
+  }
+  printf("%-22s %8.3f ms/frame %9.0f bytes/frame\n", name, ms / n,
+    (double)bytes / n);
+}
+
+//--bench-render FILE: frame building on a 300x100 screen, diffed against
+//the previous frame and repainted whole
+int editorBenchRender(char *filename) {
+  editorOpen(filename);
+  E.screen_rows = 98;
+  E.screen_cols = 300;
+  printf("%s: %d lines, %dx%d screen\n", filename, E.numrows,
+    E.screen_cols, E.screen_rows + 2);
+  editorBenchRenderRun("cursor right", 2000, 0, 1, 0);
+  editorBenchRenderRun("scroll one line", 2000, 1, 0, 0);
+  editorBenchRenderRun("page down", 500, E.screen_rows, 0, 0);
+  editorBenchRenderRun("full repaint", 500, E.screen_rows, 0, 1);
+  printf("frame buffer: %d bytes kept across frames\n", E.screen.frame.cap);
+  return 0;
+}
+
+
+/****init  ******/
+//one benchmark per run, each opens FILE into a fresh editor
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s --bench-highlight | --bench-render FILE\n", argv[0]);
+    return 1;
+  }
+  initEditorState();
+  if (!strcmp(argv[1], "--bench-highlight"))
+    return editorBenchHighlight(argv[2]);
+  if (!strcmp(argv[1], "--bench-render"))
+    return editorBenchRender(argv[2]);
+  fprintf(stderr, "%s: unknown benchmark %s\n", argv[0], argv[1]);
+  return 1;
+}
@@ -0,0 +1,386 @@
+//tests for the editor, built together with it by make test: the editor's
+//source is included whole, without its main, so every function and E
+//can be reached from here
+#define LITE_NO_MAIN
+#include "texteditor.c"
+#include <regex.h>
+
+
+/*** regex ***/
+//a random pattern over a few letters, . and a negated class, with
+//repeats, groups and alternation, nested at most four deep
+void editorTestRegexGen(char *buf, int *len, int depth) {
+  int r = rand() % (depth > 3 ? 3 : 9);
+  if (r < 3) {
+    char c = "abcAB.x"[rand() % 7];
+    if (c == 'x') {
+      memcpy(buf + *len, "[^a]", 4);
+      *len += 4;
+    } else {
+      buf[(*len)++] = c;
+    }
+  } else if (r == 3) {
+    editorTestRegexGen(buf, len, depth + 1);
+    //POSIX leaves a repeated repeat undefined
+    if (!strchr("*+?", buf[*len - 1])) buf[(*len)++] = "*+?"[rand() % 3];
+  } else if (r == 4) {
+    buf[(*len)++] = '(';
+    editorTestRegexGen(buf, len, depth + 1);
+    buf[(*len)++] = '|';
+    editorTestRegexGen(buf, len, depth + 1);
+    buf[(*len)++] = ')';
+  } else if (r == 5) {
+    buf[(*len)++] = '(';
+    editorTestRegexGen(buf, len, depth + 1);
+    editorTestRegexGen(buf, len, depth + 1);
+    buf[(*len)++] = ')';
+    buf[(*len)++] = "*+?"[rand() % 3];
+  } else {
+    editorTestRegexGen(buf, len, depth + 1);
+    editorTestRegexGen(buf, len, depth + 1);
+  }
+}
+
+//the leftmost, longest non-empty match in text[from, n), found by trying
+//every substring against full, the pattern anchored at both ends; its
+//start and its end in *end, or -1
+int editorTestRegexOracle(regex_t *full, const char *text, int n, int from,
+                          int bol, int eol, int *end) {
+  char sub[128];
+  for (int i = from; i < n && (!bol || i == 0); i++)
+    for (int j = n; j > i && (!eol || j == n); j--) {
+      memcpy(sub, text + i, j - i);
+      sub[j - i] = '\0';
+      if (regexec(full, sub, 0, NULL, 0) == 0) {
+        *end = j;
+        return i;
+      }
+    }
+  return -1;
+}
+
+//--test-regex [N]: N random patterns, 20000 by default, each searched for
+//in ten random texts, some long enough for forward runs to meet; every
+//match found walking through a text must be the one POSIX regexec finds
+int editorTestRegex(int n) {
+  srand(7);
+  int texts = 0, bad = 0;
+  for (int it = 0; it < n; it++) {
+    char core[512], pattern[520], full[520];
+    int len = 0;
+    editorTestRegexGen(core, &len, 0);
+    core[len] = '\0';
+    int bol = rand() % 6 == 0, eol = rand() % 6 == 0, icase = rand() % 2;
+    snprintf(pattern, sizeof(pattern), "%s%s%s", bol ? "^" : "", core, eol ? "$" : "");
+    snprintf(full, sizeof(full), "^(%s)$", core);
+    regex_t re;
+    if (regcomp(&re, full, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)))
+      continue;
+    searchpat pat = editorSearchCompile(pattern, icase, 1);
+    if (pat.re == NULL) {
+      printf("%s: %s\n", pattern, pat.error);
+      bad++;
+      regfree(&re);
+      continue;
+    }
+    for (int t = 0; t < 10; t++) {
+      char text[128];
+      int tlen = t == 0 && it % 20 == 0 ? 64 + rand() % 64 : rand() % 13;
+      for (int i = 0; i < tlen; i++) text[i] = "abcAB"[rand() % 5];
+      text[tlen] = '\0';
+      int from = 0, ok = 1;
+      while (ok) {
+        int end, want_end = -1;
+        int at = editorSearchNext(&pat, text, tlen, from, &end);
+        int want = editorTestRegexOracle(&re, text, tlen, from, bol, eol, &want_end);
+        ok = at == want && (at == -1 || end == want_end);
+        if (!ok && ++bad <= 10)
+          printf("%s%s on %s: [%d, %d) where regexec finds [%d, %d)\n", pattern,
+            icase ? " (icase)" : "", text, at, at == -1 ? -1 : end, want, want_end);
+        if (at == -1) break;
+        from = end;
+      }
+      texts++;
+    }
+    regfree(&re);
+    editorSearchFree(&pat);
+  }
+  printf("%d patterns, %d texts, %d mismatches\n", n, texts, bad);
+  return bad != 0;
+}
+
+
+
+/*** frames ***/
+//a terminal for --test-render: a grid of cells and their attributes that
+//frames are played on, knowing the sequences frames are made of
+struct testvt {
+  int rows;
+  int cols;
+  int y;
+  int x;
+  int attr;
+  int top;
+  int bottom;
+  int unknown;
+  char *cell;
+  unsigned char *cellattr;
+};
+
+//blank n cells of row y from x on, in the current attributes as a
+//terminal does
+void editorTestVtBlank(struct testvt *vt, int y, int x, int n) {
+  memset(&vt->cell[y * vt->cols + x], ' ', n);
+  memset(&vt->cellattr[y * vt->cols + x], vt->attr, n);
+}
+
+//scroll the region up n rows, down when n is negative
+void editorTestVtScroll(struct testvt *vt, int n) {
+  int h = vt->bottom - vt->top + 1;
+  int k = n > 0 ? n : -n;
+  if (k > h) k = h;
+  char *c = &vt->cell[vt->top * vt->cols];
+  unsigned char *a = &vt->cellattr[vt->top * vt->cols];
+  int keep = (h - k) * vt->cols;
+  int from = n > 0 ? k * vt->cols : 0;
+  int to = n > 0 ? 0 : k * vt->cols;
+  memmove(c + to, c + from, keep);
+  memmove(a + to, a + from, keep);
+  for (int y = 0; y < k; y++)
+    editorTestVtBlank(vt, n > 0 ? vt->bottom - y : vt->top + y, 0, vt->cols);
+}
+
+void editorTestVtCsi(struct testvt *vt, char final, const int *arg, int narg) {
+  int n = narg && arg[0] ? arg[0] : 1;
+  //a cursor left past the last column by a write sits on it
+  int x = vt->x < vt->cols ? vt->x : vt->cols - 1;
+  char *row = &vt->cell[vt->y * vt->cols];
+  unsigned char *rowattr = &vt->cellattr[vt->y * vt->cols];
+  int shift = n < vt->cols - x ? n : vt->cols - x;
+  switch (final) {
+    case 'H':
+      vt->y = (narg > 0 && arg[0] ? arg[0] : 1) - 1;
+      vt->x = (narg > 1 && arg[1] ? arg[1] : 1) - 1;
+      if (vt->y >= vt->rows) vt->y = vt->rows - 1;
+      if (vt->x >= vt->cols) vt->x = vt->cols - 1;
+      break;
+    case 'A':
+      vt->y = vt->y - n > 0 ? vt->y - n : 0;
+      break;
+    case 'B':
+      vt->y = vt->y + n < vt->rows ? vt->y + n : vt->rows - 1;
+      break;
+    case 'C':
+      vt->x = x + n;
+      if (vt->x >= vt->cols) vt->x = vt->cols - 1;
+      break;
+    case 'D':
+      vt->x = x - n > 0 ? x - n : 0;
+      break;
+    case 'K':
+      editorTestVtBlank(vt, vt->y, x, vt->cols - x);
+      break;
+    case 'J':
+      for (int y = 0; narg && arg[0] == 2 && y < vt->rows; y++)
+        editorTestVtBlank(vt, y, 0, vt->cols);
+      break;
+    case '@':
+      memmove(row + x + shift, row + x, vt->cols - x - shift);
+      memmove(rowattr + x + shift, rowattr + x, vt->cols - x - shift);
+      editorTestVtBlank(vt, vt->y, x, shift);
+      break;
+    case 'P':
+      memmove(row + x, row + x + shift, vt->cols - x - shift);
+      memmove(rowattr + x, rowattr + x + shift, vt->cols - x - shift);
+      editorTestVtBlank(vt, vt->y, vt->cols - shift, shift);
+      break;
+    case 'r':
+      vt->top = (narg > 0 && arg[0] ? arg[0] : 1) - 1;
+      vt->bottom = (narg > 1 && arg[1] ? arg[1] : vt->rows) - 1;
+      vt->y = vt->x = 0;
+      break;
+    case 'S':
+    case 'T':
+      editorTestVtScroll(vt, final == 'S' ? (narg ? arg[0] : 1) : -(narg ? arg[0] : 1));
+      break;
+    case 'm':
+      if (narg == 0) vt->attr = 0;
+      for (int i = 0; i < narg; i++) {
+        if (arg[i] == 0) vt->attr = 0;
+        else if (arg[i] == 7) vt->attr |= ATTR_REVERSE;
+        else if (arg[i] == 27) vt->attr &= ~ATTR_REVERSE;
+        else if (arg[i] >= 30 && arg[i] <= 37) vt->attr = (vt->attr & ~0x07) | (arg[i] - 30);
+        else if (arg[i] == 39) vt->attr &= ~0x07;
+        else vt->unknown++;
+      }
+      break;
+    default:
+      vt->unknown++;
+  }
+}
+
+//play len bytes of a frame on the grid
+void editorTestVtFeed(struct testvt *vt, const char *p, int len) {
+  for (int i = 0; i < len; i++) {
+    unsigned char c = p[i];
+    if (c == '\x1b' && i + 1 < len && p[i + 1] == '[') {
+      int arg[8], narg = 0, cur = 0, any = 0;
+      int private = i + 2 < len && p[i + 2] == '?';
+      for (i += 2 + private; i < len && (isdigit(p[i]) || p[i] == ';'); i++) {
+        any = 1;
+        if (p[i] != ';') {
+          cur = cur * 10 + p[i] - '0';
+        } else if (narg < 7) {
+          arg[narg++] = cur;
+          cur = 0;
+        }
+      }
+      if (any) arg[narg++] = cur;
+      //modes (the cursor, synchronized output) don't change what is shown
+      if (i < len && !private) editorTestVtCsi(vt, p[i], arg, narg);
+    } else if (c == '\r') {
+      vt->x = 0;
+    } else if (c == '\n') {
+      if (vt->y == vt->bottom) editorTestVtScroll(vt, 1);
+      else if (vt->y < vt->rows - 1) vt->y++;
+    } else if (c == '\b') {
+      if (vt->x >= vt->cols) vt->x = vt->cols - 1;
+      if (vt->x > 0) vt->x--;
+    } else if (c >= ' ') {
+      if (vt->x >= vt->cols) {
+        vt->x = 0;
+        if (vt->y == vt->bottom) editorTestVtScroll(vt, 1);
+        else if (vt->y < vt->rows - 1) vt->y++;
+      }
+      vt->cell[vt->y * vt->cols + vt->x] = c;
+      vt->cellattr[vt->y * vt->cols + vt->x] = vt->attr;
+      vt->x++;
+    } else {
+      vt->unknown++;
+    }
+  }
+}
+
+//whether the grid shows the frame last sent, with the cursor where it
+//belongs; says where it doesn't
+int editorTestVtCheck(struct testvt *vt, int frame) {
+  struct editorScreen *s = &E.screen;
+  int cy = E.cursor_y - E.rowoffset, cx = E.rx - E.coloffset;
+  if (vt->unknown) {
+    printf("frame %d: a sequence the terminal doesn't know\n", frame);
+    return 0;
+  }
+  for (int i = 0; i < vt->rows * vt->cols; i++)
+    if (vt->cell[i] != s->front[i] || vt->cellattr[i] != s->front_attr[i]) {
+      printf("frame %d, %dx%d: row %d column %d shows '%c' in %d, the frame has '%c' in %d\n",
+        frame, vt->cols, vt->rows, i / vt->cols, i % vt->cols, vt->cell[i],
+        vt->cellattr[i], s->front[i], s->front_attr[i]);
+      return 0;
+    }
+  if (vt->y != cy || vt->x != cx) {
+    printf("frame %d, %dx%d: cursor at %d,%d, not %d,%d\n", frame, vt->cols,
+      vt->rows, vt->y, vt->x, cy, cx);
+    return 0;
+  }
+  return 1;
+}
+
+//one random step of a session: cursor moves, typing, deleting, repaints
+//and incremental searches for text near the cursor
+void editorTestRenderStep(char *query, int *searching) {
+  static const int arrows[] = {ARROW_LEFT, ARROW_RIGHT, ARROW_UP, ARROW_DOWN};
+  int r = rand() % 20;
+  //the search prompt takes no other keys, leave it first
+  if (r < 18 && *searching) {
+    editorFindCallback(query, '\r');
+    editorSetStatusMessage("");
+    *searching = 0;
+  }
+  erow *row = editorRowAt(E.cursor_y);
+  if (r < 6) {
+    editorMoveCursor(arrows[rand() % 4]);
+  } else if (r < 8) {
+    int y = E.cursor_y + (r == 6 ? E.screen_rows : -E.screen_rows);
+    E.cursor_y = y < 0 ? 0 : y > E.numrows ? E.numrows : y;
+    editorMoveCursor(ARROW_UP);
+  } else if (r == 8) {
+    E.cursor_x = row ? row->size : 0;
+  } else if (r == 9) {
+    E.cursor_x = 0;
+  } else if (r < 14) {
+    editorInsertChar("ab {}/*\"\t#x1"[rand() % 12]);
+  } else if (r == 14) {
+    editorInsertNewline();
+  } else if (r < 17) {
+    editorDelChar();
+  } else if (r == 17) {
+    E.screen.valid = 0;
+  } else if (r == 18 && row && row->size > 0 && strlen(query) < 8) {
+    if (!*searching) {
+      editorSearchDropLevels(0);
+      editorSearchSetPrompt();
+      *searching = 1;
+      query[0] = '\0';
+    }
+    int n = strlen(query);
+    query[n] = editorRowFlatten(row)[rand() % row->size];
+    //the prompt takes no control characters
+    if (iscntrl(query[n])) query[n] = ' ';
+    query[n + 1] = '\0';
+    editorSetStatusMessage(E.search.prompt, query);
+    editorFindCallback(query, query[n]);
+  } else if (r == 19 && *searching) {
+    editorFindCallback(query, rand() % 2 ? ARROW_DOWN : ARROW_UP);
+  }
+}
+
+//--test-render FILE: random edit, scroll and search sessions at several
+//window sizes with every frame played on a terminal grid, which must then
+//show the frame cell for cell whether it was sent as a diff or whole.
+//Edits stay in memory
+int editorTestRender(char *filename) {
+  static const int sizes[][2] = {{24, 80}, {50, 132}, {12, 40}, {60, 300}};
+  editorOpen(filename);
+  E.swap.enabled = 0;
+  srand(11);
+  int frames = 0, ok = 1;
+  for (int k = 0; k < 4 && ok; k++) {
+    struct testvt vt = {sizes[k][0], sizes[k][1], 0, 0, 0, 0, sizes[k][0] - 1, 0,
+                        malloc(sizes[k][0] * sizes[k][1]),
+                        malloc(sizes[k][0] * sizes[k][1])};
+    //what the first frame doesn't clear shows up
+    memset(vt.cell, '?', vt.rows * vt.cols);
+    memset(vt.cellattr, 0, vt.rows * vt.cols);
+    E.screen_rows = vt.rows - 2;
+    E.screen_cols = vt.cols;
+    E.cursor_x = E.cursor_y = 0;
+    char query[16] = "";
+    int searching = 0;
+    for (int step = 0; step < 3000 && ok; step++) {
+      editorTestRenderStep(query, &searching);
+      struct abuf *ab = editorBuildFrame();
+      editorTestVtFeed(&vt, ab->b, ab->len);
+      ok = editorTestVtCheck(&vt, ++frames);
+    }
+    free(vt.cell);
+    free(vt.cellattr);
+  }
+  printf("%s: %d frames, %s\n", filename, frames,
+    ok ? "all shown as built" : "mismatch");
+  return !ok;
+}
+
+
+/****init  ******/
+//with no arguments every test runs, on texteditor.c where one needs a
+//file; --test-regex [N] or --test-render FILE runs just that one
+int main(int argc, char *argv[]) {
+  int all = argc < 2;
+  int failed = 0;
+  initEditorState();
+  if (all || !strcmp(argv[1], "--test-regex"))
+    failed |= editorTestRegex(!all && argc >= 3 ? atoi(argv[2]) : 20000);
+  if (all || (!strcmp(argv[1], "--test-render") && argc >= 3))
+    failed |= editorTestRender(all ? "texteditor.c" : argv[2]);
+  return failed;
+}
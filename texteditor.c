@@ -15,6 +15,20 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -23,6 +37,54 @@
 #define EDITOR_QUIT_TIMES 3 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define ADD_BLOCK_SIZE (64 * 1024)
+//rows above and below the viewport highlighted ahead of scrolling
+#define HL_PREFETCH_ROWS 8
+//rows per background highlighting job and the most worker threads
+#define HL_CHUNK_ROWS 16
+#define HL_MAX_WORKERS 8
+//rows at least this long are never rendered whole: a sparse map of byte
+//offsets to render columns, checkpointed about every COLMAP_STRIDE bytes,
+//stands in for render and only the columns on screen plus LONG_ROW_MARGIN
+//either side are rendered and highlighted
+#define LONG_ROW_BYTES (64 * 1024)
+#define COLMAP_STRIDE 1024
+#define LONG_ROW_MARGIN 256
+//files with at least this many rows get a trigram index for search; each
+//leaf's signature has TRIGRAM_BITS bits and is rebuilt after this many
+//deletions left it holding trigrams that may be gone
+#define TRIGRAM_MIN_ROWS 100000
+#define TRIGRAM_BITS 4096
+#define TRIGRAM_MAX_STALE 256
+//time spent indexing between keystrokes, in milliseconds
+#define TRIGRAM_STEP_MS 10
+//searches split across threads once there are this many rows per thread
+#define SEARCH_ROWS_PER_THREAD 16384
+#define SEARCH_MAX_THREADS 8
+//most states a lazily built regex DFA keeps before starting over
+#define REGEX_MAX_STATES 1024
+//a forward regex run notes its DFA state every this many bytes
+#define REGEX_RUN_STRIDE 64
+//pieces and newlines gathered into each writev when saving
+#define SAVE_IOV 1024
+//saves rewrite the file in place from the first changed byte when that
+//leaves at most 1/SAVE_PARTIAL_RATIO of the file to write
+#define SAVE_PARTIAL_RATIO 8
+//memory the undo journal may use before it forgets the oldest edits,
+//LITE_UNDO_MAX overrides it in bytes
+#define UNDO_MAX_BYTES (64 << 20)
+//the crash journal is rewritten from the document once this much has been
+//appended to it beyond the size of its literal text
+#define SWAP_COMPACT_BYTES (8 << 20)
+//files at least this big open in large-file mode with only a window of
+//their rows loaded, LITE_LARGE_FILE overrides it in bytes; the window and
+//its rows are kept within LARGE_MEM_CAP, or LITE_MEM_CAP bytes
+#define LARGE_FILE_BYTES (1LL << 30)
+#define LARGE_MEM_CAP (256 << 20)
+//the large-file line index holds the offset of every this many'th line
+#define LARGE_INDEX_STRIDE 4096
+//bytes of terminal input read ahead at once, a power of two
+#define INPUT_RING (16 * 1024)
 
 //home_key = start of line, end_key = end of line
 enum editorKey {
@@ -35,7 +97,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  //a bracketed paste, its text is in E.input.paste
+  PASTE
 };
 
 
@@ -46,26 +110,511 @@ enum editorHighlight {
   HL_STRING, 
   HL_COMMENT, 
   HL_KEYWORD1,
-  HL_KEYWORD2
+  HL_KEYWORD2,
+  HL_MLCOMMENT
 };
 
+//hl bytes keep the highlight class in the low bits and, at positions where
+//the lexer loop started, the lexer state in the high bits so a row can be
+//re-lexed from the middle after an edit
+#define HL_CLASS(h) ((h) & 0x07)
+#define HL_STATE(h) ((h) & 0xf8)
+#define LEX_VALID 0x08
+#define LEX_IN_DQUOTE 0x10
+#define LEX_IN_SQUOTE 0x20
+#define LEX_PREV_SEP 0x40
+#define LEX_PREV_NUM 0x80
+//a string and a block comment never overlap, so both quote bits together
+//mean inside a multi-line comment
+#define LEX_IN_COMMENT (LEX_IN_DQUOTE | LEX_IN_SQUOTE)
+
+//piece table: text is a list of spans pointing either into the read-only
+//file mapping or into the append-only add buffer that all insertions go to
+typedef struct piece {
+  const char *p;
+  int len;
+} piece;
+
+//add buffer storage, blocks are never moved or reused so pieces stay valid
+typedef struct addblock {
+  struct addblock *next;
+  int used;
+  int cap;
+  char data[];
+} addblock;
+
+//a checkpoint of a long row: byte at starts render column rx and the lexer
+//loop starts there in state (0 once the rest of the row is a line comment)
+typedef struct colmark {
+  int at;
+  int rx;
+  unsigned char state;
+} colmark;
+
+//checkpoints of a long row, extended from the row start only as far as
+//lookups reach and cut back to an edit; the states hold for the highlight
+//epoch and start state they were lexed with
+typedef struct colmap {
+  colmark *marks;
+  int n;
+  int cap;
+  //set once the checkpoints reach the row end, which sits at column width
+  int done;
+  int width;
+  unsigned int epoch;
+  unsigned char in;
+} colmap;
+
 // store location for text row in editor 
 typedef struct erow {
   int size;
   int rsize; 
-  char *chars;
+  //text of the row, a single span is kept inline (span) so unedited rows
+  //need no allocation, more spans live in the pieces array
+  piece span;
+  piece *pieces;
+  int npieces;
+  int piececap;
+  //NULL until the row is first drawn (see editorRowRender)
   char *render;
+  //render column of render[0], long rows only hold the slice being shown
+  int rstart;
+  //column map of a long row, NULL until first needed (editorRowColmap)
+  colmap *cols;
+  //tab count, valid while render is built
+  int tabs;
+  //hl is current only while this matches E.hl_epoch
+  unsigned int hl_epoch;
+  //whether the row starts and ends inside an open multi-line comment
+  unsigned char hl_in;
+  unsigned char hl_open;
+  //bumped when render or hl_in change, results lexed from an older
+  //version are dropped
+  unsigned int version;
+  //version and E.hl_gen of the row's pending background job
+  unsigned int hl_queued;
+  unsigned int hl_queued_gen;
   //highlight spec
   unsigned char *hl; 
 } erow;
 
+//a change to a row's bytes, captured before the text changes so that
+//editorUpdateRowEdit can patch render/hl around it instead of rebuilding
+typedef struct rowedit {
+  //first changed byte, -1 when the row has no render to patch
+  int at;
+  //bytes replaced and the row size before the change
+  int oldlen;
+  int oldsize;
+  //render columns where the replaced bytes started and ended
+  int rx;
+  int oldrx;
+  int oldtabs;
+} rowedit;
+
+//rows live in a counted B+ tree: leaves hold up to ROW_LEAF_MAX rows and
+//every node knows how many rows sit below it, so finding, inserting and
+//deleting a line by number is O(log n)
+#define ROW_LEAF_MAX 64
+#define ROW_FANOUT 32
+
+typedef struct rownode {
+  int leaf;
+  //kids (inner node) or rows (leaf) in use
+  int n;
+  //rows in this subtree
+  int count;
+  struct rownode *parent;
+  //leaf chain for sequential scans
+  struct rownode *prev;
+  struct rownode *next;
+  //one spare slot so a full node can take the new kid before splitting
+  struct rownode *kids[ROW_FANOUT + 1];
+  erow *rows;
+  //leaf only: a bit per hashed trigram found in its rows (see trigram
+  //index), NULL until the leaf has been indexed
+  unsigned char *tri;
+  int tri_stale;
+} rownode;
+
+//cursor for walking rows in order without a lookup per row
+typedef struct rowiter {
+  rownode *leaf;
+  int i;
+} rowiter;
+
+
+//a row handed to a highlighting worker: a copy of its render in, hl out
+typedef struct hlrow {
+  int at;
+  unsigned int version;
+  unsigned char in;
+  unsigned char open;
+  int rsize;
+  char *render;
+  unsigned char *hl;
+} hlrow;
+
+typedef struct hljob {
+  struct hljob *next;
+  struct editorSyntax *syntax;
+  unsigned int gen;
+  int n;
+  hlrow rows[HL_CHUNK_ROWS];
+} hljob;
+
+//workers take jobs from todo and leave them on done for the input thread,
+//the lock only guards the two lists
+struct editorHighlightPool {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  hljob *todo;
+  hljob *todo_tail;
+  hljob *done;
+  int nworkers;
+};
+
+//undo journal: records packed back to back in buf, each a header, len
+//bytes of text and the record's total size, so it can be walked both
+//ways; records before pos are done, the rest can be redone
+enum undoType {
+  UNDO_INSERT = 1,
+  UNDO_DELETE,
+  UNDO_SPLIT,
+  UNDO_JOIN,
+  UNDO_OPEN,
+  //removing an opened row, only ever made as the inverse of UNDO_OPEN
+  UNDO_CLOSE
+};
+//set on a record's type when it is undone and redone with the one before
+#define UNDO_CHAINED 0x100
+
+typedef struct undorec {
+  int type;
+  int y;
+  int x;
+  int len;
+} undorec;
+
+struct editorUndo {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  size_t max;
+  //set while undoing or redoing so the edits made are not recorded, and
+  //after it so the next edit doesn't merge into an older record
+  int replaying;
+  int sealed;
+  //nonzero while edits are grouped, counting the records made so far
+  int group;
+};
+
+//large-file mode: the rows are a window onto the mapped file, lines
+//[line, line + E.numrows) at bytes [start, end). A background thread
+//notes where every LARGE_INDEX_STRIDE'th line starts so far lines are
+//found without scanning from the top
+struct editorLarge {
+  int on;
+  size_t cap;
+  size_t start;
+  size_t end;
+  long long line;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+  int stop;
+  //index[k] is where line k * LARGE_INDEX_STRIDE starts; lines counted
+  //so far, all of them once indexed is set
+  size_t *index;
+  long long nindex;
+  long long indexcap;
+  long long lines;
+  int indexed;
+};
+
+//terminal input read ahead into a ring, tail - head bytes are queued
+struct editorInput {
+  unsigned char ring[INPUT_RING];
+  unsigned int head;
+  unsigned int tail;
+  //text of the last bracketed paste
+  char *paste;
+  size_t pastelen;
+  size_t pastecap;
+};
+
+//crash journal ("swap file") beside the file being edited: a header
+//naming the version of the file it applies to, optionally a base that
+//rebuilds the whole document from runs of that file and literal text,
+//then one record per edit. Edits queue up in pending and a writer thread
+//appends and syncs everything queued since its last pass, so typing never
+//waits on the disk.
+enum swapRun {
+  SWAP_COPY = 16,
+  SWAP_TEXT
+};
+
+struct editorSwap {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  int enabled;
+  int started;
+  int stop;
+  int busy;
+  char *path;
+  //size, mtime and inode of the file the journal replays onto
+  unsigned long long id[4];
+  //set while an in-place save rewrites the file: the base reads no more
+  //than the file's first id[0] bytes and only those and the inode name it
+  int prefix;
+  //-1 until the first edit creates the journal
+  int fd;
+  unsigned char *pending;
+  size_t len;
+  size_t cap;
+  //appended since the base, and the base's literal text
+  size_t size;
+  size_t basesize;
+  //a base for the writer to restart the journal with, and the mapping
+  //its runs of the file point into
+  struct iovec *base;
+  int nbase;
+  const char *map;
+  size_t maplen;
+  //edits replayed from the journal when the file was opened
+  int recovered;
+  //N when a journal found on open didn't match the file and was moved
+  //to path.N
+  int aside;
+};
+
+//a save running in the background: the writer thread writes iov, a
+//snapshot of the document's text, to target and sets done under the lock
+struct editorSaveJob {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+  int done;
+  char *target;
+  struct iovec *iov;
+  int niov;
+  //E.dirty when the snapshot was taken
+  int dirty;
+  //file offset iov is written at in place, or -1 to replace the file,
+  //and bytes after it that stay as they are
+  long long offset;
+  long long keep;
+  double start;
+  double ms;
+  long long bytes;
+  //the written file, left open for remapping the rows, and errno when
+  //the save failed
+  int fd;
+  int err;
+};
+
+//a compiled search query, first and last are folded when ignoring case;
+//regex queries keep their automata in re, or the reason they would not
+//compile in error
+typedef struct searchpat {
+  const char *s;
+  int len;
+  int icase;
+  unsigned char first;
+  unsigned char last;
+  struct searchregex *re;
+  const char *error;
+} searchpat;
+
+//regex NFA instructions; a SET instruction consumes a byte of its set
+enum { RI_SET, RI_SPLIT, RI_JMP, RI_MATCH };
+
+typedef struct reinst {
+  int op;
+  int set;
+  int x;
+  int y;
+} reinst;
+
+typedef struct reprog {
+  reinst *inst;
+  int n;
+  int cap;
+} reprog;
+
+//a DFA state: the NFA instructions it stands for
+typedef struct redstate {
+  int *insts;
+  int n;
+} redstate;
+
+//a DFA built lazily over prog; state 0 is the dead state and state 1 the
+//start. trans has a row of stride ints per state: an edge per byte class,
+//holding the target's row offset or -1 until first taken, then whether
+//the state holds a match. An unanchored DFA can begin a match at every
+//byte
+typedef struct redfa {
+  const reprog *prog;
+  const unsigned char (*sets)[32];
+  const unsigned char *rep;
+  int nclasses;
+  int stride;
+  int unanchored;
+  redstate *states;
+  int nstates;
+  int *trans;
+  int *table;
+  unsigned int *seen;
+  unsigned int stamp;
+  int *list;
+  int *stack;
+  int *saved;
+  //times the cache started over, state offsets from before are stale
+  int resets;
+} redfa;
+
+//a compiled regex: NFAs reading forwards and backwards over shared byte
+//sets, which split the bytes into classes that no set tells apart. The
+//programs belong to the owner, copies made for search threads only get
+//DFAs and scratch of their own
+typedef struct searchregex {
+  int owner;
+  reprog fwd;
+  reprog rev;
+  unsigned char (*sets)[32];
+  int nsets;
+  unsigned char classof[256];
+  unsigned char classrep[256];
+  int nclasses;
+  //^ and $ at the ends of the pattern
+  int bol;
+  int eol;
+  //literals every match contains, longest first; rows missing one of
+  //them are skipped
+  char **lits;
+  searchpat *litpats;
+  int nlits;
+  redfa fdfa;
+  redfa rdfa;
+  unsigned char *starts;
+  int startcap;
+  //the last forward run: its state at every REGEX_RUN_STRIDE'th byte up
+  //to runend, and the end of its match
+  int *runstates;
+  int runend;
+  int runbest;
+  int runresets;
+} searchregex;
+
+//rows containing one query, sorted, and where each row's matches start in
+//the list of all matches; a longer query only needs to look at the rows a
+//prefix of it matched
+typedef struct searchlevel {
+  char *query;
+  int *rows;
+  int *first;
+  int n;
+  int total;
+} searchlevel;
+
+struct editorSearchState {
+  int icase;
+  int regex;
+  //the Ctrl-F prompt, rewritten when a mode flips
+  char prompt[96];
+  //the last query compiled, in the modes it was compiled for
+  char *patquery;
+  int patmodes;
+  searchpat pat;
+  //candidate sets of ever longer prefixes of the current query
+  searchlevel *levels;
+  int nlevels;
+  //while the prompt is up: whether the top level is the query being
+  //shown, and the match the cursor is on
+  int active;
+  int current;
+};
+
+//per-phase timings of the last editorOpen, in milliseconds
+struct editorOpenStats {
+  int mapped;
+  double map_ms;
+  double index_ms;
+  double rows_ms;
+  double total_ms;
+};
+
+//keywords with the '|' type marker already decoded into a highlight class
+struct editorKeyword {
+  const char *word;
+  int len;
+  unsigned char hl;
+};
+
+//perfect hash over a syntax's keywords, built once at startup: every
+//keyword has a slot of its own so a lookup is one hash and one compare
+struct editorKeywordTable {
+  struct editorKeyword *slots;
+  unsigned int mask;
+  unsigned int seed;
+  int minlen;
+  int maxlen;
+  //bytes some keyword starts with, to skip hashing most words
+  unsigned char first[256];
+};
 
 struct editorSyntax {
   char *filetype;
   char **filematch;
   char **keywords;
   char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
   int flags;
+  //compiled from keywords by editorCompileKeywords
+  struct editorKeywordTable *kwtable;
+};
+
+//cell attributes: the foreground colour (0 for the default, else the SGR
+//code less 30) and reverse video
+#define ATTR_FG(a) ((a) & 0x07)
+#define ATTR_REVERSE 0x08
+#define ATTR_STATES 16
+#define ATTR_UNKNOWN ATTR_STATES
+
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+//the frame being drawn (back) and what the terminal shows (front), a byte
+//and an attribute plane each, with the terminal's cursor and attributes
+//as last left (-1 when unknown). Frames are built in frame, which is
+//kept from one to the next
+struct editorScreen {
+  int rows;
+  int cols;
+  char *front;
+  char *back;
+  unsigned char *front_attr;
+  unsigned char *back_attr;
+  int valid;
+  int cy;
+  int cx;
+  int attr;
+  //the viewport the terminal shows, to spot frames that only scroll
+  int rowoffset;
+  int coloffset;
+  //the terminal does synchronized output (DEC mode 2026)
+  int sync;
+  struct abuf frame;
+  //the last frame: time to build it and bytes sent
+  double build_ms;
+  int bytes;
 };
 
 //raw mode is neccessary so text editor can continue accepting input 
@@ -81,11 +630,56 @@ struct editorConfig{
   //keeps track of unsaved changes, dirty flag 
   int dirty; 
   int numrows; 
-  erow *row; 
+  rownode *rows;
   char *filename;
+  //read-only mapping of the opened file that unedited rows point into
+  char *map;
+  size_t maplen;
+  //bytes at the start of the mapping that still hold what the file on
+  //disk does, less than maplen once a save rewrote the file under it
+  size_t mapsame;
+  //the mapped file as it was mapped, and whether it holds exactly the
+  //rows (no carriage returns, a final newline), so unedited rows sit at
+  //their own offset in it
+  struct stat mapstat;
+  int map_exact;
+  //rows above this are unedited since the file was mapped, a save only
+  //has to rewrite from there
+  int save_clean;
+  //newest add buffer block first
+  addblock *add;
+  //the add buffer block and its fill when the last snapshot was taken,
+  //bytes below this may still be read by a writer thread
+  addblock *addpin;
+  int addpinused;
+  struct editorOpenStats openstats;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  //bumped whenever every row's highlighting goes stale (filetype change)
+  unsigned int hl_epoch;
+  //rows above this have hl_in/hl_open chained down from the first row
+  int hl_frontier;
+  //bumped when row indexes shift or the filetype changes, background
+  //results from an older generation are dropped
+  unsigned int hl_gen;
+  struct editorHighlightPool hlpool;
+  struct editorSaveJob saving;
+  struct editorUndo undo;
+  struct editorSwap swap;
+  struct editorLarge large;
+  struct editorSearchState search;
+  //trigram index: on for large files, tri_next is the next leaf the
+  //idle-time builder looks at
+  int tri_enabled;
+  rownode *tri_next;
+  struct editorScreen screen;
+  struct editorInput input;
+  //what the event loop sleeps on besides the terminal: SIGWINCH, the
+  //status message's expiry, and background threads finishing work
+  int sigfd;
+  int timerfd;
+  int wakefd;
   struct termios original_term;
 };
 
@@ -118,8 +712,9 @@ struct editorSyntax HLDB[] = {
     "c",
     C_HL_extensions,
     C_HL_keywords,
-    "//",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
 };
 
@@ -130,6 +725,43 @@ void editorSetStatusMessage(const char *fmt, ...);
 //prototype for refreshing editor screen
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+const char *editorRowFlatten(erow *row);
+void editorRowRender(erow *row);
+int editorRowExpand(erow *row, int from, int to, int rx, char *dst, int *tabs);
+colmark *editorColmapFind(erow *row, int at, int rx);
+void editorColmapFree(erow *row);
+int editorHighlightCollect();
+int editorSaveCollect(int wait);
+void editorUndoRecord(int type, int y, int x, const char *text, int len);
+void editorUndoGroup(int on);
+int getWindowSize(int *rows, int *cols);
+void editorSwapRecord(int type, int y, int x, const char *text, int len);
+char *editorSwapPath(const char *filename);
+int editorSwapAside(const char *path);
+const unsigned char *editorSwapRead(const char *filename, const struct stat *st,
+                                    unsigned char **buf, const unsigned char **end);
+const unsigned char *editorSwapLoadBase(const unsigned char *p, const unsigned char *end,
+                                        int fd);
+int editorSwapReplay(const unsigned char **p, const unsigned char *end);
+void editorSwapStart(const char *filename, off_t keep);
+void editorSwapReset();
+int editorSwapThread();
+void editorSwapCompact();
+void editorSwapPrefix(off_t offset);
+void editorSwapWait();
+void editorLargeOpen();
+void editorRowTreeFree(rownode *node);
+void editorLargeIndexStart();
+void editorLargeIndexStop();
+void editorLargeRelease(size_t from, size_t to);
+struct iovec *editorLargeSnapshot(struct iovec *iov, int *niov, long long *bytes);
+void editorSearchDropLevels(int n);
+void editorScroll();
+void editorSaveRowChanged(int at);
+void editorTrigramRowChanged(int at, int from, int to);
+void editorTrigramBuildStep();
+searchpat editorSearchCompile(const char *query, int icase, int regex);
+int editorSearchText(const searchpat *pat, const char *text, int len, int from);
 
 //terminal functions
 
@@ -141,7 +773,15 @@ void die(const char *s) {
   exit(1);
 }
 
+//monotonic clock in milliseconds, used for timing the open/save paths
+double editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_term) == -1)
     die("tcsetattr failed");
 }
@@ -169,68 +809,254 @@ void enableRawMode() {
   //min number of bytes of input needed for read() can return 
   //set to 0 so that read() returns as soon as there is any input to be read
   raw.c_cc[VMIN] = 0;
-  //vtime value sets max amount of time to wait before read() returns (1 = 1/10 of a second)
-  //if there is no input for a period of time, should see VMIN value being printed out to the console every 10th of a second
-  raw.c_cc[VTIME] = 1;
+  //no read() timeout either, waiting for input is done with poll()
+  raw.c_cc[VTIME] = 0;
 
   //TCSAFlush discards additional input 
   if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
   {
     die("tcsetattr failed"); 
   }
+  //bracketed paste: the terminal marks pasted text so it arrives as one
+  //PASTE key instead of being typed in
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+//reads whatever input is waiting into the ring without blocking; 0 when
+//there is none
+int editorInputFill() {
+  struct editorInput *in = &E.input;
+  unsigned int off = in->tail & (INPUT_RING - 1);
+  unsigned int room = INPUT_RING - (in->tail - in->head);
+  if (room > INPUT_RING - off) room = INPUT_RING - off;
+  if (room == 0) return 0;
+  int nread = read(STDIN_FILENO, in->ring + off, room);
+  if (nread == -1 && errno != EAGAIN) 
+    die("retry read");
+  if (nread <= 0) return 0;
+  in->tail += nread;
+  return nread;
+}
+
+//waits up to ms for input, then reads it into the ring
+int editorInputWait(int ms) {
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  if (poll(&p, 1, ms) <= 0) return 0;
+  return editorInputFill();
+}
+
+//whether a key is queued or can be read right away
+int editorInputPending() {
+  return E.input.tail != E.input.head || editorInputFill();
+}
+
+//lets the event loop know a background thread has results to show
+void editorWake() {
+  uint64_t one = 1;
+  if (E.wakefd != -1)
+    write(E.wakefd, &one, sizeof(one));
+}
+
+//the window size changed: size the text area to it again
+void editorResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+  E.screen_rows = rows > 2 ? rows - 2 : 1;
+  E.screen_cols = cols > 0 ? cols : 1;
+}
+
+//sleeps until there is input, handling what else wakes it: a resize,
+//the status message timing out, or highlighting and saves finishing in
+//the background; only spins while the trigram index is being built
+void editorWaitEvent() {
+  struct pollfd fds[4] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { E.sigfd, POLLIN, 0 },
+    { E.timerfd, POLLIN, 0 },
+    { E.wakefd, POLLIN, 0 },
+  };
+  int building = E.tri_enabled && E.tri_next != NULL;
+  if (poll(fds, 4, building ? 0 : -1) == -1 && errno != EINTR)
+    die("poll");
+
+  int redraw = 0;
+  if (fds[1].revents & POLLIN) {
+    struct signalfd_siginfo si;
+    while (read(E.sigfd, &si, sizeof(si)) == sizeof(si));
+    editorResize();
+    redraw = 1;
+  }
+  if (fds[2].revents & POLLIN) {
+    uint64_t n;
+    read(E.timerfd, &n, sizeof(n));
+    redraw = 1;
+  }
+  if (fds[3].revents & POLLIN) {
+    uint64_t n;
+    read(E.wakefd, &n, sizeof(n));
+  }
+  redraw |= editorHighlightCollect() | editorSaveCollect(0);
+  if (redraw) editorRefreshScreen();
+  editorTrigramBuildStep();
+}
+
+//SIGWINCH is taken through a descriptor instead of a handler; it is
+//blocked before any thread starts so none of them gets it
+void editorEventsStart() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) 
+    die("sigprocmask");
+  E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  E.timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  E.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (E.sigfd == -1 || E.timerfd == -1 || E.wakefd == -1) 
+    die("event fds");
+}
+
+int editorInputPeek(unsigned int i) {
+  return E.input.ring[(E.input.head + i) & (INPUT_RING - 1)];
+}
+
+//decodes the key at the front of the ring without waiting, *used set to
+//its length in bytes; -1 when the ring ends before a whole key and -2 for
+//a sequence that is no key (a terminal report or one not known here),
+//which is dropped whole
+int editorInputDecode(int *used) {
+  unsigned int n = E.input.tail - E.input.head;
+  *used = 1;
+  if (n == 0) return -1;
+  int c = editorInputPeek(0);
+  if (c != '\x1b') return c;
+  if (n < 2) return -1;
+  int s0 = editorInputPeek(1);
+  if (s0 != '[' && s0 != 'O') return '\x1b';
+  if (n < 3) return -1;
+  if (s0 == 'O') {
+    *used = 3;
+    switch (editorInputPeek(2)) {
+      case 'H': return HOME_KEY;
+      case 'F': return END_KEY;
+    }
+    return '\x1b';
+  }
+
+  //ESC [, parameter bytes 0x30-0x3f, intermediate bytes 0x20-0x2f and a
+  //final byte 0x40-0x7e; the first parameter picks the key for ~
+  //sequences, the rest (modifiers) are ignored, and keys never carry a
+  //private marker (?<=>) or intermediates
+  unsigned int i = 2;
+  int num = 0, arg = 0, params = 0, plain = 1, inter = 0;
+  int marker = editorInputPeek(i) >= 0x3c && editorInputPeek(i) <= 0x3f ?
+               editorInputPeek(i) : 0;
+  while (i < n && editorInputPeek(i) >= 0x30 && editorInputPeek(i) <= 0x3f) {
+    int b = editorInputPeek(i++);
+    if (b == ';') params++;
+    else if (!isdigit(b)) plain = 0;
+    else if (params == 0 && num < 10000) num = num * 10 + b - '0';
+    else if (params == 1 && arg < 10000) arg = arg * 10 + b - '0';
+  }
+  while (i < n && editorInputPeek(i) >= 0x20 && editorInputPeek(i) <= 0x2f) {
+    inter = editorInputPeek(i++);
+    plain = 0;
+  }
+  if (i == n) return -1;
+  int final = editorInputPeek(i);
+  if (final < 0x40 || final > 0x7e) return '\x1b';
+  *used = i + 1;
+  //the answer to editorSyncProbe: ESC [ ? 2026 ; state $ y, state 1 (set)
+  //or 2 (reset) when the terminal knows the mode
+  if (marker == '?' && inter == '$' && final == 'y' && num == 2026)
+    E.screen.sync = arg == 1 || arg == 2;
+  if (!plain) return -2;
+  switch (final) {
+    case '~':
+      switch (num) {
+        case 1: return HOME_KEY;
+        case 3: return DEL_KEY;
+        case 4: return END_KEY;
+        case 5: return PAGE_UP;
+        case 6: return PAGE_DOWN;
+        case 7: return HOME_KEY;
+        case 8: return END_KEY;
+        case 200: return PASTE;
+      }
+      break;
+    case 'A': return ARROW_UP;
+    case 'B': return ARROW_DOWN;
+    case 'C': return ARROW_RIGHT;
+    case 'D': return ARROW_LEFT;
+    case 'H': return HOME_KEY;
+    case 'F': return END_KEY;
+  }
+  return -2;
+}
+
+//moves a paste's text from the ring into E.input.paste up to its end
+//marker, giving up after a second without input
+void editorInputPaste() {
+  struct editorInput *in = &E.input;
+  size_t scan = 0;
+  int idle = 0;
+  in->pastelen = 0;
+  while (idle < 10) {
+    unsigned int n = in->tail - in->head;
+    if (n == 0) {
+      idle = editorInputWait(100) ? 0 : idle + 1;
+      continue;
+    }
+    unsigned int off = in->head & (INPUT_RING - 1);
+    if (n > INPUT_RING - off) n = INPUT_RING - off;
+    if (in->pastelen + n > in->pastecap) {
+      in->pastecap = (in->pastelen + n) * 2;
+      in->paste = realloc(in->paste, in->pastecap);
+    }
+    memcpy(in->paste + in->pastelen, in->ring + off, n);
+    in->pastelen += n;
+    in->head += n;
+
+    char *mark = memmem(in->paste + scan, in->pastelen - scan, "\x1b[201~", 6);
+    if (mark) {
+      //whatever followed the marker is typed input again
+      in->head -= in->paste + in->pastelen - (mark + 6);
+      in->pastelen = mark - in->paste;
+      return;
+    }
+    scan = in->pastelen > 5 ? in->pastelen - 5 : 0;
+  }
 }
 
 //reads characters (either regular char or escape seq)
 int editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) 
-      die("retry read");
-  }
-
-  if (c == '\x1b') {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-    //read into seq buffer for arrow key input (escape sequence)
-    if (seq[0] == '[') {
-      //page up/down keys
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      } 
-      else {
-      switch (seq[1]) {
-        case 'A': return ARROW_UP;
-        case 'B': return ARROW_DOWN;
-        case 'C': return ARROW_RIGHT;
-        case 'D': return ARROW_LEFT;
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-      }
+  struct editorInput *in = &E.input;
+  int c, used;
+  while ((c = editorInputDecode(&used)) < 0) {
+    if (c == -2) {
+      in->head += used;
+      continue;
     }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-      }
+    if (editorInputFill()) continue;
+    //an unfinished sequence that nothing follows for a tenth of a second
+    //is a lone escape key
+    if (in->tail != in->head) {
+      if (editorInputWait(100)) continue;
+      c = '\x1b';
+      used = 1;
+      break;
     }
-    return '\x1b';
-  } 
-  else {
-    return c;
+    editorWaitEvent();
   }
+  in->head += used;
+  if (c == PASTE) editorInputPaste();
+  return c;
+}
+
+//one byte of a terminal reply, waiting up to a tenth of a second for it
+int editorReadByte(char *c) {
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  if (poll(&p, 1, 100) <= 0) return 0;
+  return read(STDIN_FILENO, c, 1);
 }
 
 //grabs current cursor position 
@@ -242,7 +1068,7 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) 
     return -1;
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (editorReadByte(&buf[i]) != 1) break;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -257,6 +1083,15 @@ int getCursorPosition(int *rows, int *cols) {
   return 0;
 }
 
+//asks whether the terminal does synchronized output (DEC mode 2026)
+//without waiting: the reply comes in with the keys whenever it arrives,
+//however slow the link, and editorInputDecode turns E.screen.sync on;
+//terminals that ignore the query never send one and frames stay plain
+void editorSyncProbe() {
+  E.screen.sync = 0;
+  write(STDOUT_FILENO, "\x1b[?2026$p", 9);
+}
+
 //grabs the size of terminal
 //if ioctl fails, consult escape sequence query (position cursor at very end and grab position)
 int getWindowSize(int *rows, int *cols) {
@@ -274,40 +1109,352 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** row tree ***/
+rownode *rowNodeNew(int leaf) {
+  rownode *node = calloc(1, sizeof(rownode));
+  node->leaf = leaf;
+  if (leaf)
+    node->rows = malloc(sizeof(erow) * ROW_LEAF_MAX);
+  return node;
+}
+
+void rowNodeRecount(rownode *node) {
+  int k;
+  node->count = 0;
+  for (k = 0; k < node->n; k++)
+    node->count += node->kids[k]->count;
+}
+
+//find the leaf holding row at and its index inside that leaf
+//at == E.numrows resolves to one past the last row of the last leaf
+rownode *rowTreeFind(int at, int *idx) {
+  rownode *node = E.rows;
+  while (!node->leaf) {
+    int k = 0;
+    //appends go straight down the right edge
+    if (at >= node->count) {
+      k = node->n - 1;
+      at -= node->count - node->kids[k]->count;
+    }
+    for (; k < node->n - 1; k++) {
+      if (at < node->kids[k]->count) break;
+      at -= node->kids[k]->count;
+    }
+    node = node->kids[k];
+  }
+  *idx = at;
+  return node;
+}
+
+//link sib into the tree right after node, splitting parents as needed
+//row counts above node are unchanged since sib's rows came out of node
+void rowNodeAttach(rownode *node, rownode *sib) {
+  rownode *p = node->parent;
+  int fresh = 0;
+  if (p == NULL) {
+    p = rowNodeNew(0);
+    p->kids[p->n++] = node;
+    node->parent = p;
+    E.rows = p;
+    fresh = 1;
+  }
+  int k = 0;
+  while (p->kids[k] != node) k++;
+  memmove(&p->kids[k + 2], &p->kids[k + 1], sizeof(rownode *) * (p->n - k - 1));
+  p->kids[k + 1] = sib;
+  sib->parent = p;
+  p->n++;
+  if (fresh)
+    rowNodeRecount(p);
+
+  if (p->n > ROW_FANOUT) {
+    //a kid added at the very end starts a new node so bulk appends pack
+    //nodes full, anything else splits evenly
+    int mid = (k + 1 == p->n - 1) ? p->n - 1 : p->n / 2;
+    rownode *right = rowNodeNew(0);
+    right->n = p->n - mid;
+    memcpy(right->kids, &p->kids[mid], sizeof(rownode *) * right->n);
+    p->n = mid;
+    for (k = 0; k < right->n; k++)
+      right->kids[k]->parent = right;
+    rowNodeRecount(p);
+    rowNodeRecount(right);
+    rowNodeAttach(p, right);
+  }
+}
+
+//unlink an empty node, dropping parents that become empty and collapsing
+//a root left with a single kid
+void rowNodeDetach(rownode *node) {
+  rownode *p = node->parent;
+  int k = 0;
+  while (p->kids[k] != node) k++;
+  memmove(&p->kids[k], &p->kids[k + 1], sizeof(rownode *) * (p->n - k - 1));
+  p->n--;
+  if (node->leaf) {
+    if (node->prev) node->prev->next = node->next;
+    if (node->next) node->next->prev = node->prev;
+    if (E.tri_next == node) E.tri_next = node->next;
+  }
+  free(node->rows);
+  free(node->tri);
+  free(node);
+
+  if (p->n == 0 && p->parent) {
+    rowNodeDetach(p);
+    return;
+  }
+  while (E.rows->n == 1 && !E.rows->leaf) {
+    rownode *root = E.rows;
+    E.rows = root->kids[0];
+    E.rows->parent = NULL;
+    free(root);
+  }
+}
+
+//open a slot for a new row at index at and return it uninitialized
+erow *editorRowSlot(int at) {
+  int i;
+  rownode *leaf = rowTreeFind(at, &i);
+  if (leaf->n == ROW_LEAF_MAX) {
+    //as with inner nodes, appending past a full leaf starts a new one
+    int mid = (i == ROW_LEAF_MAX) ? ROW_LEAF_MAX : ROW_LEAF_MAX / 2;
+    rownode *right = rowNodeNew(1);
+    right->n = leaf->n - mid;
+    memcpy(right->rows, &leaf->rows[mid], sizeof(erow) * right->n);
+    leaf->n = mid;
+    leaf->count = leaf->n;
+    right->count = right->n;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) leaf->next->prev = right;
+    leaf->next = right;
+    //both halves keep the whole signature, a superset of their trigrams
+    if (leaf->tri) {
+      right->tri = malloc(TRIGRAM_BITS / 8);
+      memcpy(right->tri, leaf->tri, TRIGRAM_BITS / 8);
+      right->tri_stale = leaf->tri_stale;
+    }
+    rowNodeAttach(leaf, right);
+    if (i >= mid) {
+      leaf = right;
+      i -= mid;
+    }
+  }
+  memmove(&leaf->rows[i + 1], &leaf->rows[i], sizeof(erow) * (leaf->n - i));
+  leaf->n++;
+  rownode *node;
+  for (node = leaf; node; node = node->parent)
+    node->count++;
+  E.numrows++;
+  return &leaf->rows[i];
+}
+
+//drop the row at index at from the tree (the caller frees its contents)
+void editorRowRemove(int at) {
+  int i;
+  rownode *leaf = rowTreeFind(at, &i);
+  memmove(&leaf->rows[i], &leaf->rows[i + 1], sizeof(erow) * (leaf->n - i - 1));
+  leaf->n--;
+  rownode *node;
+  for (node = leaf; node; node = node->parent)
+    node->count--;
+  E.numrows--;
+  if (leaf->n == 0 && leaf->parent)
+    rowNodeDetach(leaf);
+}
+
+//row at line index at, valid until the next row insert or delete
+erow *editorRowAt(int at) {
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+  int i;
+  rownode *leaf = rowTreeFind(at, &i);
+  return &leaf->rows[i];
+}
+
+erow *editorRowIterGet(rowiter *it) {
+  while (it->leaf && it->i >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->i = 0;
+  }
+  return it->leaf ? &it->leaf->rows[it->i] : NULL;
+}
+
+erow *editorRowIterStart(rowiter *it, int at) {
+  it->leaf = rowTreeFind(at, &it->i);
+  return editorRowIterGet(it);
+}
+
+erow *editorRowIterNext(rowiter *it) {
+  it->i++;
+  return editorRowIterGet(it);
+}
+
+//separator bytes, filled in by editorInitSyntaxTables
+unsigned char separators[256];
+
 //makes sure digits are standalone for syntax highlighting
 int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return separators[(unsigned char)c];
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+unsigned int editorKeywordHash(const char *s, int len, unsigned int seed) {
+  unsigned int h = seed;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+//try to place every keyword in a table of mask + 1 slots without collisions
+int editorKeywordPlace(struct editorKeywordTable *t, struct editorKeyword *kw,
+                       int n, unsigned int mask, unsigned int seed) {
+  struct editorKeyword *slots = calloc(mask + 1, sizeof(struct editorKeyword));
+  for (int j = 0; j < n; j++) {
+    struct editorKeyword *k = &slots[editorKeywordHash(kw[j].word, kw[j].len, seed) & mask];
+    if (k->len) {
+      free(slots);
+      return 0;
+    }
+    *k = kw[j];
+  }
+  t->slots = slots;
+  t->mask = mask;
+  t->seed = seed;
+  return 1;
+}
+
+//decode the keyword list into a perfect hash table, growing the table
+//until some seed spreads the keywords without collisions
+void editorCompileKeywords(struct editorSyntax *syn) {
+  struct editorKeywordTable *t = calloc(1, sizeof(*t));
+  int n = 0;
+  while (syn->keywords[n]) n++;
+  struct editorKeyword *kw = malloc(sizeof(*kw) * (n + 1));
+  int nkw = 0;
+  t->minlen = 0;
+  for (int j = 0; j < n; j++) {
+    int klen = strlen(syn->keywords[j]);
+    int kw2 = syn->keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    //the first of a repeated keyword wins, as with a linear scan
+    int k;
+    for (k = 0; k < nkw; k++)
+      if (kw[k].len == klen && !strncmp(kw[k].word, syn->keywords[j], klen))
+        break;
+    if (k < nkw || klen == 0) continue;
+    kw[nkw].word = syn->keywords[j];
+    kw[nkw].len = klen;
+    kw[nkw].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    nkw++;
+    t->first[(unsigned char)syn->keywords[j][0]] = 1;
+    if (t->minlen == 0 || klen < t->minlen) t->minlen = klen;
+    if (klen > t->maxlen) t->maxlen = klen;
+  }
+  unsigned int mask = 1;
+  while (mask + 1 < (unsigned int)nkw * 2) mask = mask * 2 + 1;
+  for (;; mask = mask * 2 + 1) {
+    unsigned int seed;
+    for (seed = 1; seed <= 4096; seed++)
+      if (editorKeywordPlace(t, kw, nkw, mask, seed * 2654435761u)) break;
+    if (seed <= 4096) break;
+  }
+  free(kw);
+  syn->kwtable = t;
+}
 
-  if (E.syntax == NULL) return;
+void editorInitSyntaxTables() {
+  for (int c = 0; c < 256; c++)
+    separators[c] = isspace(c) || c == '\0' ||
+      strchr(",.()+-/*=~%<>[];", c) != NULL;
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    editorCompileKeywords(&HLDB[j]);
+}
 
-  char **keywords = E.syntax->keywords;
+//length of the keyword that is the whole word starting at s, 0 if none
+int editorKeywordAt(struct editorSyntax *syn, const char *s, unsigned char *hl) {
+  struct editorKeywordTable *t = syn->kwtable;
+  if (!t->first[(unsigned char)s[0]]) return 0;
+  int len = 1;
+  while (len <= t->maxlen && !is_separator(s[len])) len++;
+  if (len < t->minlen || len > t->maxlen) return 0;
+  struct editorKeyword *k = &t->slots[editorKeywordHash(s, len, t->seed) & t->mask];
+  if (k->len != len || memcmp(k->word, s, len)) return 0;
+  *hl = k->hl;
+  return len;
+}
 
-  char *scs = E.syntax->singleline_comment_start;
+//keyword matcher used by the lexer, swapped out by bench.c
+int (*editorKeywordMatch)(struct editorSyntax *syn, const char *s,
+                          unsigned char *hl) = editorKeywordAt;
+
+//run the lexer over render from loop position i with the given state,
+//storing class and state into hl; from column converge on it stops at the
+//first position whose state saved by the previous pass matches, since the
+//text and hl after that point are then unchanged
+void editorLexRow(struct editorSyntax *syn, erow *row, int i,
+                  unsigned char state, int converge) {
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
   int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
 
-  int prev_sep = 1;
-  int in_string = 0;
+  int prev_sep = (state & LEX_PREV_SEP) != 0;
+  int in_comment = (state & LEX_IN_COMMENT) == LEX_IN_COMMENT;
+  int in_string = in_comment ? 0 : (state & LEX_IN_DQUOTE) ? '"' :
+                  (state & LEX_IN_SQUOTE) ? '\'' : 0;
 
-  int i = 0;
+  //the class before the first position comes from state, the slice of a
+  //long row starts mid-row with nothing before it
+  int first = i;
   while (i < row->rsize) {
     char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    unsigned char prev_hl = (i > first) ? HL_CLASS(row->hl[i - 1]) :
+                            (state & LEX_PREV_NUM) ? HL_NUMBER : HL_NORMAL;
+    unsigned char st = LEX_VALID;
+    if (in_comment) st |= LEX_IN_COMMENT;
+    if (in_string) st |= (in_string == '"') ? LEX_IN_DQUOTE : LEX_IN_SQUOTE;
+    if (prev_sep) st |= LEX_PREV_SEP;
+    if (prev_hl == HL_NUMBER) st |= LEX_PREV_NUM;
+    if (i >= converge && HL_STATE(row->hl[i]) == st)
+      return;
+    row->hl[i] = HL_NORMAL | st;
 
-    if (scs_len && !in_string) {
+    if (scs_len && !in_string && !in_comment && c == scs[0]) {
       if (!strncmp(&row->render[i], scs, scs_len)) {
         memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        row->hl[i] |= st;
         break;
       }
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        row->hl[i] = HL_MLCOMMENT | st;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          memset(&row->hl[i + 1], HL_MLCOMMENT, mce_len - 1);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        } else {
+          i++;
+          continue;
+        }
+      } else if (c == mcs[0] && !strncmp(&row->render[i], mcs, mcs_len)) {
+        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        row->hl[i] |= st;
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
+        row->hl[i] = HL_STRING | st;
         if (c == '\\' && i + 1 < row->rsize) {
           row->hl[i + 1] = HL_STRING;
           i += 2;
@@ -320,17 +1467,17 @@ void editorUpdateSyntax(erow *row) {
       } else {
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          row->hl[i] = HL_STRING | st;
           i++;
           continue;
         }
       }
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
       if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        row->hl[i] = HL_NUMBER | st;
         i++;
         prev_sep = 0;
         continue;
@@ -338,19 +1485,12 @@ void editorUpdateSyntax(erow *row) {
     }
 
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+      unsigned char kwhl;
+      int klen = editorKeywordMatch(syn, &row->render[i], &kwhl);
+      if (klen) {
+        memset(&row->hl[i], kwhl, klen);
+        row->hl[i] |= st;
+        i += klen;
         prev_sep = 0;
         continue;
       }
@@ -359,12 +1499,179 @@ void editorUpdateSyntax(erow *row) {
     prev_sep = is_separator(c);
     i++;
   }
+  row->hl_open = in_comment;
+}
+
+//lexer state at the start of a row that starts inside a comment or not
+unsigned char editorLexStartState(int in) {
+  return LEX_VALID | LEX_PREV_SEP | (in ? LEX_IN_COMMENT : 0);
+}
+
+//lex all of render into hl starting inside an open comment or not, only
+//the row itself is touched so workers can run it on copies
+void editorLexWholeRow(struct editorSyntax *syn, erow *row, int in) {
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->hl_in = in;
+  row->hl_open = 0;
+
+  if (syn == NULL) return;
+
+  editorLexRow(syn, row, 0, editorLexStartState(in), row->rsize + 1);
+}
+
+void editorUpdateSyntax(erow *row, int in) {
+  row->hl = realloc(row->hl, row->rsize + 1);
+  row->hl_epoch = E.hl_epoch;
+  editorLexWholeRow(E.syntax, row, in);
+}
+
+//whether a row that starts with in ends inside an open comment, from its
+//text alone; follows the comment and string rules of editorLexRow
+int editorScanRowState(erow *row, int in) {
+  if (E.syntax == NULL) return 0;
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  if (!mcs || !mce || !*mcs || !*mce) return 0;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = strlen(mcs);
+  int mce_len = strlen(mce);
+  int strings = E.syntax->flags & HL_HIGHLIGHT_STRINGS;
+
+  const char *s = editorRowFlatten(row);
+  int n = row->size;
+  int in_string = 0;
+  int i = 0;
+  while (i < n) {
+    char c = s[i];
+    if (in) {
+      if (c == mce[0] && i + mce_len <= n && !memcmp(&s[i], mce, mce_len)) {
+        i += mce_len;
+        in = 0;
+      } else {
+        i++;
+      }
+      continue;
+    }
+    if (in_string) {
+      if (c == '\\' && i + 1 < n) {
+        i += 2;
+        continue;
+      }
+      if (c == in_string) in_string = 0;
+      i++;
+      continue;
+    }
+    if (scs_len && c == scs[0] && i + scs_len <= n && !memcmp(&s[i], scs, scs_len))
+      return 0;
+    if (c == mcs[0] && i + mcs_len <= n && !memcmp(&s[i], mcs, mcs_len)) {
+      i += mcs_len;
+      in = 1;
+      continue;
+    }
+    if (strings && (c == '"' || c == '\''))
+      in_string = c;
+    i++;
+  }
+  return in;
+}
+
+//move the frontier down to row at, scanning the comment state of rows on
+//the way that were never lexed or were lexed from a different state
+void editorSyntaxScanTo(int at) {
+  if (at <= E.hl_frontier) return;
+  int j = E.hl_frontier;
+  int in = j > 0 ? editorRowAt(j - 1)->hl_open : 0;
+  rowiter it;
+  erow *row;
+  for (row = editorRowIterStart(&it, j); row && j < at;
+       row = editorRowIterNext(&it), j++) {
+    if (row->hl_epoch != E.hl_epoch || row->hl_in != in) {
+      if (row->hl_in != in) row->version++;
+      row->hl_epoch = 0;
+      row->hl_in = in;
+      row->hl_open = editorScanRowState(row, in);
+    }
+    in = row->hl_open;
+  }
+  E.hl_frontier = j;
+}
+
+//the text of row at changed: refresh its end state and carry a change
+//forward only until a row is found that already started in the carried
+//state; past the screen the frontier is pulled back instead, so opening a
+//comment never rescans the rest of the file eagerly
+void editorSyntaxRowChanged(int at) {
+  if (at < 0 || at >= E.hl_frontier) return;
+  rowiter it;
+  erow *row = editorRowIterStart(&it, at);
+  if (row->hl_epoch != E.hl_epoch)
+    row->hl_open = editorScanRowState(row, row->hl_in);
+  int in = row->hl_open;
+  int last = E.rowoffset + E.screen_rows + HL_PREFETCH_ROWS;
+  for (at++, row = editorRowIterNext(&it); row && at < E.hl_frontier;
+       at++, row = editorRowIterNext(&it)) {
+    if (row->hl_in == in) return;
+    if (at >= last) {
+      E.hl_frontier = at;
+      return;
+    }
+    //relexed from the new state when drawn
+    row->hl_epoch = 0;
+    row->hl_in = in;
+    row->version++;
+    row->hl_open = editorScanRowState(row, in);
+    in = row->hl_open;
+  }
+}
+
+//rows were inserted or deleted at at
+void editorSyntaxRowsMoved(int at) {
+  if (at < E.hl_frontier)
+    E.hl_frontier = at;
+  E.hl_gen++;
+}
+
+//how far back an edit can change highlighting: the longest keyword plus
+//the separator after it, or the comment marker
+int editorSyntaxLookbehind() {
+  static struct editorSyntax *cached = NULL;
+  static int lookbehind = 0;
+  if (E.syntax != cached) {
+    cached = E.syntax;
+    char *markers[] = { E.syntax->singleline_comment_start,
+      E.syntax->multiline_comment_start, E.syntax->multiline_comment_end };
+    lookbehind = 0;
+    for (int j = 0; j < 3; j++)
+      if (markers[j] && (int)strlen(markers[j]) > lookbehind)
+        lookbehind = strlen(markers[j]);
+    if (E.syntax->kwtable->maxlen + 1 > lookbehind)
+      lookbehind = E.syntax->kwtable->maxlen + 1;
+  }
+  return lookbehind;
+}
+
+//re-lex after render changed from column rx up to column end: resume from
+//a saved state far enough before rx and run until the states converge
+void editorUpdateSyntaxRange(erow *row, int rx, int end) {
+  if (E.syntax == NULL) {
+    memset(&row->hl[rx], HL_NORMAL, end - rx);
+    return;
+  }
+  int r = rx - editorSyntaxLookbehind();
+  while (r > 0 && !(row->hl[r] & LEX_VALID))
+    r--;
+  if (r <= 0)
+    editorLexRow(E.syntax, row, 0, editorLexStartState(row->hl_in), end);
+  else
+    editorLexRow(E.syntax, row, r, HL_STATE(row->hl[r]), end);
 }
 
 //map h1 values to ANSI color codes 
 int editorSyntaxToColor(int hl) {
   switch (hl) {
-    case HL_COMMENT: return 36;
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
     case HL_KEYWORD1: return 33;
     case HL_KEYWORD2: return 32;
     case HL_STRING: return 35;
@@ -374,9 +1681,13 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
-//sets E.syntax based on filename
+//sets E.syntax based on filename, rows pick up the new highlighting
+//lazily when they are next drawn
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
+  E.hl_epoch++;
+  E.hl_frontier = 0;
+  E.hl_gen++;
   if (E.filename == NULL) return;
   char *ext = strrchr(E.filename, '.');
   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
@@ -387,10 +1698,6 @@ void editorSelectSyntaxHighlight() {
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(E.filename, s->filematch[i]))) {
         E.syntax = s;
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
         return;
       }
       i++;
@@ -398,304 +1705,3667 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
-int editorRowCursor_xToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
-    rx++;
+/*** background highlighting ***/
+void *editorHighlightWorker(void *arg) {
+  struct editorHighlightPool *pool = arg;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->todo == NULL)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    hljob *job = pool->todo;
+    pool->todo = job->next;
+    if (pool->todo == NULL) pool->todo_tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int k = 0; k < job->n; k++) {
+      hlrow *r = &job->rows[k];
+      erow tmp;
+      memset(&tmp, 0, sizeof(tmp));
+      tmp.render = r->render;
+      tmp.rsize = r->rsize;
+      tmp.hl = malloc(r->rsize + 1);
+      editorLexWholeRow(job->syntax, &tmp, r->in);
+      r->hl = tmp.hl;
+      r->open = tmp.hl_open;
+      free(r->render);
+      r->render = NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    job->next = pool->done;
+    pool->done = job;
+    pthread_mutex_unlock(&pool->lock);
+    editorWake();
   }
-  return rx;
+  return NULL;
 }
 
-int editorRowRxToCursor_x(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
+//one worker per spare core; with none started rows are lexed inline
+void editorHighlightPoolStart() {
+  struct editorHighlightPool *pool = &E.hlpool;
+  long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n < 1) n = 1;
+  if (n > HL_MAX_WORKERS) n = HL_MAX_WORKERS;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+  for (pool->nworkers = 0; pool->nworkers < n; pool->nworkers++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, editorHighlightWorker, pool) != 0)
+      break;
+    pthread_detach(tid);
   }
-  return cx;
 }
 
-//grab chars string on an erow to fill render string (deals with tab spacings)
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs*(EDITOR_TAB_STOP - 1) + 1);
+void editorHighlightJobFree(hljob *job) {
+  for (int k = 0; k < job->n; k++) {
+    free(job->rows[k].render);
+    free(job->rows[k].hl);
+  }
+  free(job);
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % EDITOR_TAB_STOP != 0) 
-        row->render[idx++] = ' ';
+//queue the stale rows among [first, last) that are not already queued,
+//dropping queued jobs nobody can use anymore
+void editorHighlightSubmit(int first, int last) {
+  struct editorHighlightPool *pool = &E.hlpool;
+  hljob *head = NULL, *tail = NULL, *job = NULL;
+  rowiter it;
+  erow *row;
+  int at = first;
+  for (row = editorRowIterStart(&it, first); row && at < last;
+       row = editorRowIterNext(&it), at++) {
+    if (row->hl_epoch == E.hl_epoch) continue;
+    if (row->hl_queued == row->version && row->hl_queued_gen == E.hl_gen)
+      continue;
+    if (job == NULL || job->n == HL_CHUNK_ROWS) {
+      job = malloc(sizeof(hljob));
+      job->next = NULL;
+      job->syntax = E.syntax;
+      job->gen = E.hl_gen;
+      job->n = 0;
+      if (tail) tail->next = job;
+      else head = job;
+      tail = job;
+    }
+    hlrow *r = &job->rows[job->n++];
+    r->at = at;
+    r->version = row->version;
+    r->in = row->hl_in;
+    r->rsize = row->rsize;
+    r->render = malloc(row->rsize + 1);
+    memcpy(r->render, row->render, row->rsize + 1);
+    r->hl = NULL;
+    row->hl_queued = row->version;
+    row->hl_queued_gen = E.hl_gen;
+  }
+
+  hljob *stale = NULL;
+  pthread_mutex_lock(&pool->lock);
+  hljob **pp = &pool->todo;
+  pool->todo_tail = NULL;
+  while (*pp) {
+    if ((*pp)->gen != E.hl_gen) {
+      hljob *j = *pp;
+      *pp = j->next;
+      j->next = stale;
+      stale = j;
     } else {
-      row->render[idx++] = row->chars[j];
+      pool->todo_tail = *pp;
+      pp = &(*pp)->next;
+    }
+  }
+  if (head) {
+    if (pool->todo_tail) pool->todo_tail->next = head;
+    else pool->todo = head;
+    pool->todo_tail = tail;
+    pthread_cond_broadcast(&pool->ready);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  while (stale) {
+    hljob *next = stale->next;
+    editorHighlightJobFree(stale);
+    stale = next;
+  }
+}
+
+//take finished jobs and install every result whose row is still at the
+//same index with the same version, return how many rows got highlighting
+int editorHighlightCollect() {
+  struct editorHighlightPool *pool = &E.hlpool;
+  if (pool->nworkers == 0) return 0;
+  pthread_mutex_lock(&pool->lock);
+  hljob *done = pool->done;
+  pool->done = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  int applied = 0;
+  while (done) {
+    hljob *job = done;
+    done = job->next;
+    for (int k = 0; job->gen == E.hl_gen && k < job->n; k++) {
+      hlrow *r = &job->rows[k];
+      erow *row = editorRowAt(r->at);
+      if (row == NULL || row->version != r->version ||
+          row->hl_epoch == E.hl_epoch)
+        continue;
+      free(row->hl);
+      row->hl = r->hl;
+      r->hl = NULL;
+      row->hl_epoch = E.hl_epoch;
+      row->hl_open = r->open;
+      applied++;
+    }
+    editorHighlightJobFree(job);
+  }
+  return applied;
+}
+
+/*** piece table ***/
+//copy s into the add buffer and return where it landed
+const char *editorAddText(const char *s, int len) {
+  addblock *b = E.add;
+  if (b == NULL || b->cap - b->used < len) {
+    int cap = len > ADD_BLOCK_SIZE ? len : ADD_BLOCK_SIZE;
+    b = malloc(sizeof(addblock) + cap);
+    b->next = E.add;
+    b->used = 0;
+    b->cap = cap;
+    E.add = b;
+  }
+  char *dst = b->data + b->used;
+  memcpy(dst, s, len);
+  b->used += len;
+  return dst;
+}
+
+//true when end is the write position of the add buffer, so the piece that
+//ends there can grow in place
+int editorAddIsTail(const char *end) {
+  return E.add && end == E.add->data + E.add->used;
+}
+
+//a snapshot pointing into the add buffer is being handed to another
+//thread: the bytes written so far must stay as they are
+void editorAddPin() {
+  E.addpin = E.add;
+  E.addpinused = E.add ? E.add->used : 0;
+}
+
+//give back the last byte written, unless a snapshot may still read it
+void editorAddUnwrite() {
+  if (E.add == E.addpin && E.add->used <= E.addpinused) return;
+  E.add->used--;
+}
+
+void editorAddFree(addblock *b) {
+  while (b) {
+    addblock *next = b->next;
+    free(b);
+    b = next;
+  }
+}
+
+piece *editorRowPieces(erow *row) {
+  return row->pieces ? row->pieces : &row->span;
+}
+
+int editorRowIsLong(erow *row) {
+  return row->size >= LONG_ROW_BYTES;
+}
+
+//replace the row text with a single span (or nothing when len is 0)
+void editorRowSetSpan(erow *row, const char *p, int len) {
+  free(row->pieces);
+  row->pieces = NULL;
+  row->piececap = 0;
+  row->span.p = p;
+  row->span.len = len;
+  row->npieces = len > 0;
+  row->size = len;
+}
+
+//insert n pieces before piece index k
+void editorRowInsertPieces(erow *row, int k, const piece *src, int n) {
+  if (row->npieces + n > 1 && row->npieces + n > row->piececap) {
+    int cap = row->piececap ? row->piececap * 2 : 4;
+    while (cap < row->npieces + n) cap *= 2;
+    if (row->pieces == NULL) {
+      row->pieces = malloc(sizeof(piece) * cap);
+      if (row->npieces) row->pieces[0] = row->span;
+    } else {
+      row->pieces = realloc(row->pieces, sizeof(piece) * cap);
+    }
+    row->piececap = cap;
+  }
+  piece *pc = editorRowPieces(row);
+  memmove(&pc[k + n], &pc[k], sizeof(piece) * (row->npieces - k));
+  memcpy(&pc[k], src, sizeof(piece) * n);
+  row->npieces += n;
+  int j;
+  for (j = 0; j < n; j++)
+    row->size += src[j].len;
+}
+
+//make sure a piece starts at byte offset at and return its index
+//(npieces when at is the end of the row)
+int editorRowSplit(erow *row, int at) {
+  piece *pc = editorRowPieces(row);
+  int k, off = 0;
+  for (k = 0; k < row->npieces; k++) {
+    if (at == off) return k;
+    if (at < off + pc[k].len) {
+      piece tail = { pc[k].p + (at - off), pc[k].len - (at - off) };
+      pc[k].len = at - off;
+      row->size -= tail.len;
+      editorRowInsertPieces(row, k + 1, &tail, 1);
+      return k + 1;
+    }
+    off += pc[k].len;
+  }
+  return k;
+}
+
+//merge spans that are adjacent in memory, drop empty ones and move a lone
+//span back inline
+void editorRowCompact(erow *row) {
+  if (row->pieces == NULL) {
+    row->npieces = row->span.len > 0;
+    return;
+  }
+  piece *pc = row->pieces;
+  int k, n = 0;
+  for (k = 0; k < row->npieces; k++) {
+    if (pc[k].len == 0) continue;
+    if (n > 0 && pc[n - 1].p + pc[n - 1].len == pc[k].p)
+      pc[n - 1].len += pc[k].len;
+    else
+      pc[n++] = pc[k];
+  }
+  row->npieces = n;
+  if (n <= 1) {
+    piece one = n ? pc[0] : (piece){ NULL, 0 };
+    editorRowSetSpan(row, one.p, one.len);
+  }
+}
+
+//contiguous copy of the row text, a single span is returned as is and
+//anything else is gathered into the caller's scratch buffer
+const char *editorRowText(erow *row, char **scratch, int *cap) {
+  if (row->pieces == NULL)
+    return row->npieces ? row->span.p : "";
+  if (row->size > *cap) {
+    *cap = row->size * 2;
+    *scratch = realloc(*scratch, *cap);
+  }
+  int k, off = 0;
+  for (k = 0; k < row->npieces; k++) {
+    memcpy(*scratch + off, row->pieces[k].p, row->pieces[k].len);
+    off += row->pieces[k].len;
+  }
+  return *scratch;
+}
+
+//copy bytes [from, to) of row into dst
+void editorRowCopy(erow *row, int from, int to, char *dst) {
+  piece *pc = editorRowPieces(row);
+  int k, off = 0;
+  for (k = 0; k < row->npieces && from < to; k++) {
+    int j = from - off;
+    off += pc[k].len;
+    if (j >= pc[k].len) continue;
+    int n = pc[k].len - j;
+    if (n > to - from) n = to - from;
+    memcpy(dst, pc[k].p + j, n);
+    dst += n;
+    from += n;
+  }
+}
+
+//editorRowText into a shared scratch buffer valid until the next call
+const char *editorRowFlatten(erow *row) {
+  static char *scratch = NULL;
+  static int scratchcap = 0;
+  return editorRowText(row, &scratch, &scratchcap);
+}
+
+int editorRowCursor_xToRx(erow *row, int cx) {
+  //long rows count from the nearest checkpoint
+  if (editorRowIsLong(row)) {
+    colmark *mk = editorColmapFind(row, cx, -1);
+    return editorRowExpand(row, mk->at, cx, mk->rx, NULL, NULL);
+  }
+  //without tabs bytes and columns line up
+  if (row->render && row->tabs == 0)
+    return cx;
+  piece *pc = editorRowPieces(row);
+  int rx = 0;
+  int j, k;
+  for (k = 0; k < row->npieces && cx > 0; k++) {
+    for (j = 0; j < pc[k].len && cx > 0; j++, cx--) {
+      if (pc[k].p[j] == '\t')
+        rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
+      rx++;
+    }
+  }
+  return rx;
+}
+
+int editorRowRxToCursor_x(erow *row, int rx) {
+  piece *pc = editorRowPieces(row);
+  int cur_rx = 0;
+  int cx = 0;
+  if (editorRowIsLong(row)) {
+    colmark *mk = editorColmapFind(row, -1, rx);
+    cx = mk->at;
+    cur_rx = mk->rx;
+  }
+  int j, k, off = 0;
+  for (k = 0; k < row->npieces; off += pc[k].len, k++) {
+    if (cx >= off + pc[k].len) continue;
+    for (j = cx - off; j < pc[k].len; j++, cx++) {
+      if (pc[k].p[j] == '\t')
+        cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
+      cur_rx++;
+      if (cur_rx > rx) return cx;
+    }
+  }
+  return cx;
+}
+
+//grab chars string on an erow to fill render string (deals with tab spacings)
+//reads straight through the row's pieces
+void editorUpdateRow(erow *row) {
+  if (editorRowIsLong(row)) {
+    //long rows render a slice when drawn (editorRowRenderSlice), their
+    //column map was already cut back by editorRowBeginEdit
+    free(row->render);
+    row->render = NULL;
+    row->rsize = 0;
+    row->rstart = 0;
+    row->hl_epoch = 0;
+    row->version++;
+    return;
+  }
+  editorColmapFree(row);
+  row->rstart = 0;
+  piece *pc = editorRowPieces(row);
+  int tabs = 0;
+  int j, k;
+  for (k = 0; k < row->npieces; k++)
+    for (j = 0; j < pc[k].len; j++)
+      if (pc[k].p[j] == '\t') tabs++;
+  row->tabs = tabs;
+  free(row->render);
+  row->render = malloc(row->size + tabs*(EDITOR_TAB_STOP - 1) + 1);
+
+  int idx = 0;
+  for (k = 0; k < row->npieces; k++) {
+    for (j = 0; j < pc[k].len; j++) {
+      if (pc[k].p[j] == '\t') {
+        row->render[idx++] = ' ';
+        while (idx % EDITOR_TAB_STOP != 0) 
+          row->render[idx++] = ' ';
+      } else {
+        row->render[idx++] = pc[k].p[j];
+      }
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+
+  //highlighting follows when the row is drawn (editorHighlightViewport)
+  row->hl_epoch = 0;
+  row->version++;
+}
+
+//expand bytes [from, to) starting at render column rx into dst, with
+//column rx landing at dst[0] (or just measure when dst is NULL), return the
+//column after them and add the tabs seen to *tabs
+int editorRowExpand(erow *row, int from, int to, int rx, char *dst, int *tabs) {
+  piece *pc = editorRowPieces(row);
+  int start = rx;
+  int k, off = 0;
+  for (k = 0; k < row->npieces && from < to; k++) {
+    int j = from - off;
+    off += pc[k].len;
+    if (j >= pc[k].len) continue;
+    for (; j < pc[k].len && from < to; j++, from++) {
+      if (pc[k].p[j] == '\t') {
+        if (tabs) (*tabs)++;
+        do {
+          if (dst) dst[rx - start] = ' ';
+          rx++;
+        } while (rx % EDITOR_TAB_STOP != 0);
+      } else {
+        if (dst) dst[rx - start] = pc[k].p[j];
+        rx++;
+      }
+    }
+  }
+  return rx;
+}
+
+//the column map of a long row with at least its first checkpoint, started
+//over when the highlight epoch or the row's start state changed
+colmap *editorRowColmap(erow *row) {
+  colmap *m = row->cols;
+  if (m == NULL)
+    m = row->cols = calloc(1, sizeof(colmap));
+  if (m->n == 0 || m->epoch != E.hl_epoch || m->in != row->hl_in) {
+    if (m->cap == 0) {
+      m->cap = 64;
+      m->marks = malloc(sizeof(colmark) * m->cap);
+    }
+    m->marks[0].at = 0;
+    m->marks[0].rx = 0;
+    m->marks[0].state = editorLexStartState(row->hl_in);
+    m->n = 1;
+    m->done = 0;
+    m->epoch = E.hl_epoch;
+    m->in = row->hl_in;
+  }
+  return m;
+}
+
+void editorColmapFree(erow *row) {
+  if (row->cols == NULL) return;
+  free(row->cols->marks);
+  free(row->cols);
+  row->cols = NULL;
+}
+
+//the row changes from byte at on: drop the checkpoints whose placement
+//lexed ahead into the change
+void editorColmapCut(erow *row, int at) {
+  colmap *m = row->cols;
+  if (m == NULL) return;
+  while (m->n > 1 && m->marks[m->n - 1].at + LONG_ROW_MARGIN > at)
+    m->n--;
+  m->done = 0;
+}
+
+//add the checkpoint after the last one: the bytes from it to a stride on
+//plus a margin are lexed and the new checkpoint goes at the first byte past
+//the stride where the lexer loop started, so lexing can resume there exactly
+void editorColmapStep(erow *row, colmap *m) {
+  static char *text = NULL;
+  static char *render = NULL;
+  static unsigned char *hl = NULL;
+  static int cap = 0;
+  colmark last = m->marks[m->n - 1];
+  int to = last.at + COLMAP_STRIDE;
+  if (to >= row->size) {
+    m->width = editorRowExpand(row, last.at, row->size, last.rx, NULL, NULL);
+    m->done = 1;
+    return;
+  }
+  int end = to + LONG_ROW_MARGIN < row->size ? to + LONG_ROW_MARGIN : row->size;
+  int len = end - last.at;
+  if (len * EDITOR_TAB_STOP + 1 > cap) {
+    cap = len * EDITOR_TAB_STOP + 1;
+    text = realloc(text, cap);
+    render = realloc(render, cap);
+    hl = realloc(hl, cap);
+  }
+  //the bytes as a row of their own to expand and lex
+  erow seg;
+  memset(&seg, 0, sizeof(seg));
+  editorRowCopy(row, last.at, end, text);
+  editorRowSetSpan(&seg, text, len);
+
+  int b = to - last.at;
+  colmark next = { to, editorRowExpand(&seg, 0, b, last.rx, NULL, NULL), last.state };
+  if (E.syntax && last.state) {
+    seg.render = render;
+    seg.rsize = editorRowExpand(&seg, 0, len, last.rx, render, NULL) - last.rx;
+    render[seg.rsize] = '\0';
+    seg.hl = hl;
+    editorLexRow(E.syntax, &seg, 0, last.state, seg.rsize + 1);
+    int c = next.rx;
+    for (; b < len; b++) {
+      if (hl[c - last.rx] & LEX_VALID) break;
+      c = editorRowExpand(&seg, b, b + 1, c, NULL, NULL);
+    }
+    if (b < len) {
+      next.at = last.at + b;
+      next.rx = c;
+      next.state = HL_STATE(hl[c - last.rx]);
+    } else if (end == row->size) {
+      //a token runs into the row end, the last checkpoint covers the rest
+      m->width = c;
+      m->done = 1;
+      return;
+    } else {
+      //only a line comment runs past the margin, it takes the rest
+      next.state = 0;
+    }
+  }
+  if (m->n == m->cap) {
+    m->cap *= 2;
+    m->marks = realloc(m->marks, sizeof(colmark) * m->cap);
+  }
+  m->marks[m->n++] = next;
+}
+
+//the last checkpoint of a long row at or before byte at, or when at is -1
+//at or before column rx, adding checkpoints until one lies past it
+colmark *editorColmapFind(erow *row, int at, int rx) {
+  colmap *m = editorRowColmap(row);
+  while (!m->done && (at >= 0 ? m->marks[m->n - 1].at <= at :
+                                m->marks[m->n - 1].rx <= rx))
+    editorColmapStep(row, m);
+  int lo = 0, hi = m->n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (at >= 0 ? m->marks[mid].at <= at : m->marks[mid].rx <= rx) lo = mid;
+    else hi = mid - 1;
+  }
+  return &m->marks[lo];
+}
+
+//render and highlight the columns of a long row on screen plus a margin
+//either side, kept while they still cover the screen; lexing starts at the
+//checkpoint before them so nothing further left is touched
+void editorRowRenderSlice(erow *row) {
+  int first = E.coloffset;
+  int last = E.coloffset + E.screen_cols;
+  colmap *m = editorRowColmap(row);
+  if (row->render && row->hl_epoch == E.hl_epoch && row->rstart <= first &&
+      (row->rstart + row->rsize >= last ||
+       (m->done && row->rstart + row->rsize == m->width)))
+    return;
+
+  colmark from = *editorColmapFind(row, -1,
+    first > LONG_ROW_MARGIN ? first - LONG_ROW_MARGIN : 0);
+  int stop = editorRowRxToCursor_x(row, last + LONG_ROW_MARGIN);
+  if (stop < row->size) stop++;
+  free(row->render);
+  row->render = malloc((stop - from.at) * EDITOR_TAB_STOP + 1);
+  row->rstart = from.rx;
+  row->rsize = editorRowExpand(row, from.at, stop, from.rx, row->render, NULL) -
+               from.rx;
+  row->render[row->rsize] = '\0';
+  row->hl = realloc(row->hl, row->rsize + 1);
+
+  //hl_open stays as scanned for the whole row, not where the slice ends
+  unsigned char open = row->hl_open;
+  if (E.syntax && from.state)
+    editorLexRow(E.syntax, row, 0, from.state, row->rsize + 1);
+  else
+    memset(row->hl, E.syntax ? HL_COMMENT : HL_NORMAL, row->rsize);
+  row->hl_open = open;
+  row->hl_epoch = E.hl_epoch;
+  row->version++;
+}
+
+//the byte at offset at
+char editorRowByteAt(erow *row, int at) {
+  piece *pc = editorRowPieces(row);
+  int k;
+  for (k = 0; at >= pc[k].len; k++)
+    at -= pc[k].len;
+  return pc[k].p[at];
+}
+
+//byte offset of the first c at or after from, or -1
+int editorRowFindByte(erow *row, int from, int c) {
+  piece *pc = editorRowPieces(row);
+  int k, off = 0;
+  for (k = 0; k < row->npieces; k++) {
+    int j = from > off ? from - off : 0;
+    if (j < pc[k].len) {
+      const char *hit = memchr(pc[k].p + j, c, pc[k].len - j);
+      if (hit) return off + (hit - pc[k].p);
+    }
+    off += pc[k].len;
+  }
+  return -1;
+}
+
+//record where the bytes [at, at + oldlen) sit in render before they change
+void editorRowBeginEdit(erow *row, rowedit *ed, int at, int oldlen) {
+  //long rows have no whole render to patch, only checkpoints to cut
+  if (editorRowIsLong(row))
+    editorColmapCut(row, at);
+  ed->at = row->render && !editorRowIsLong(row) ? at : -1;
+  if (ed->at == -1)
+    return;
+  ed->oldlen = oldlen;
+  ed->oldsize = row->size;
+  ed->rx = (at == row->size) ? row->rsize : editorRowCursor_xToRx(row, at);
+  ed->oldtabs = 0;
+  ed->oldrx = editorRowExpand(row, at, at + oldlen, ed->rx, NULL, &ed->oldtabs);
+}
+
+//patch render/hl after an edit: only the changed bytes are re-expanded,
+//the columns after them shift until a tab stop absorbs the difference,
+//and the lexer resumes near the edit until its state converges
+void editorUpdateRowEdit(erow *row, rowedit *ed) {
+  if (ed->at == -1 || editorRowIsLong(row)) {
+    editorUpdateRow(row);
+    return;
+  }
+  int newlen = ed->oldlen + row->size - ed->oldsize;
+  int newtabs = 0;
+  int nc = editorRowExpand(row, ed->at, ed->at + newlen, ed->rx, NULL, &newtabs);
+  int oc = ed->oldrx;
+  int b = ed->at + newlen;
+  int tail_tabs = row->tabs - ed->oldtabs > 0;
+  while (nc != oc && tail_tabs) {
+    int tab = editorRowFindByte(row, b, '\t');
+    if (tab == -1) break;
+    nc += tab - b;
+    oc += tab - b;
+    nc += EDITOR_TAB_STOP - nc % EDITOR_TAB_STOP;
+    oc += EDITOR_TAB_STOP - oc % EDITOR_TAB_STOP;
+    b = tab + 1;
+  }
+
+  //render [rx, nc) is rewritten from bytes [at, b), the old columns from
+  //oc onwards slide over to nc unchanged
+  //stale hl is rebuilt whole when the row is drawn, so only patch it
+  //while it is current
+  int fresh = row->hl_epoch == E.hl_epoch;
+  int oldrsize = row->rsize;
+  int rsize = nc + (oldrsize - oc);
+  if (rsize > oldrsize) {
+    row->render = realloc(row->render, rsize + 1);
+    if (fresh) row->hl = realloc(row->hl, rsize + 1);
+  }
+  memmove(&row->render[nc], &row->render[oc], oldrsize - oc + 1);
+  if (fresh) memmove(&row->hl[nc], &row->hl[oc], oldrsize - oc);
+  editorRowExpand(row, ed->at, b, ed->rx, &row->render[ed->rx], NULL);
+  row->rsize = rsize;
+  row->tabs += newtabs - ed->oldtabs;
+  row->version++;
+
+  if (fresh)
+    editorUpdateSyntaxRange(row, ed->rx, nc);
+}
+
+//build render on first use for rows created without it (mapped rows),
+//long rows get the slice currently on screen
+void editorRowRender(erow *row) {
+  if (editorRowIsLong(row))
+    editorRowRenderSlice(row);
+  else if (row->render == NULL)
+    editorUpdateRow(row);
+}
+
+//make sure render and hl of row at are current, highlighting only happens
+//here so rows nobody looks at are never lexed
+erow *editorRowHighlight(int at) {
+  editorSyntaxScanTo(at + 1);
+  erow *row = editorRowAt(at);
+  editorRowRender(row);
+  if (row->hl_epoch != E.hl_epoch)
+    editorUpdateSyntax(row, row->hl_in);
+  return row;
+}
+
+//open a row at index at holding the given pieces
+void editorInsertRowPieces(int at, const piece *src, int n) {
+  if (at < 0 || at > E.numrows) 
+    return;
+  erow *row = editorRowSlot(at);
+  memset(row, 0, sizeof(erow));
+  editorRowInsertPieces(row, 0, src, n);
+  editorUpdateRow(row);
+  editorSyntaxRowsMoved(at);
+  editorTrigramRowChanged(at, 0, row->size);
+  editorSaveRowChanged(at);
+
+  E.dirty++;
+}
+
+//copy string into the add buffer and open a row for it
+void editorInsertRow(int at, char *s, size_t len) {
+  piece pc = { editorAddText(s, len), len };
+  editorInsertRowPieces(at, &pc, len > 0);
+}
+
+//free memory owned by specific erow (the text itself is shared storage)
+void editorFreeRow(erow *row) {
+  free(row->render);
+  free(row->pieces);
+  free(row->hl);
+  editorColmapFree(row);
+}
+
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) 
+    return;
+  editorTrigramRowChanged(at, 0, 0);
+  editorFreeRow(editorRowAt(at));
+  editorRowRemove(at);
+  editorSyntaxRowsMoved(at);
+  editorSaveRowChanged(at);
+  E.dirty++;
+}
+
+//inserts character into erow with given position
+//typing where the last insertion stopped just grows that add piece
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) 
+    at = row->size;
+  char ch = c;
+  rowedit ed;
+  editorRowBeginEdit(row, &ed, at, 0);
+  piece *pc = editorRowPieces(row);
+  int k, off = 0;
+  for (k = 0; k < row->npieces && off + pc[k].len < at; k++)
+    off += pc[k].len;
+  if (k < row->npieces && off + pc[k].len == at &&
+      editorAddIsTail(pc[k].p + pc[k].len) && E.add->used < E.add->cap) {
+    E.add->data[E.add->used++] = ch;
+    pc[k].len++;
+    row->size++;
+  } else {
+    piece ins = { editorAddText(&ch, 1), 1 };
+    editorRowInsertPieces(row, editorRowSplit(row, at), &ins, 1);
+  }
+  editorUpdateRowEdit(row, &ed);
+  E.dirty++;
+}
+
+//append pieces to a row, only span descriptors are copied
+void editorRowAppendPieces(erow *row, const piece *src, int n) {
+  rowedit ed;
+  editorRowBeginEdit(row, &ed, row->size, 0);
+  editorRowInsertPieces(row, row->npieces, src, n);
+  editorRowCompact(row);
+  editorUpdateRowEdit(row, &ed);
+  E.dirty++;
+}
+
+//appending a string to a row
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  piece pc = { editorAddText(s, len), len };
+  editorRowAppendPieces(row, &pc, len > 0);
+}
+
+//delete character in erow by cutting it out of its piece
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  rowedit ed;
+  editorRowBeginEdit(row, &ed, at, 1);
+  int k = editorRowSplit(row, at);
+  editorRowSplit(row, at + 1);
+  piece *pc = editorRowPieces(row);
+  //give the byte back if it was the last one typed
+  if (editorAddIsTail(pc[k].p + pc[k].len))
+    editorAddUnwrite();
+  pc[k].len = 0;
+  row->size--;
+  editorRowCompact(row);
+  editorUpdateRowEdit(row, &ed);
+  E.dirty++;
+}
+
+//insert len bytes, none of them newlines, as one piece
+void editorRowInsertText(erow *row, int at, const char *s, int len) {
+  if (at < 0 || at > row->size) 
+    at = row->size;
+  rowedit ed;
+  editorRowBeginEdit(row, &ed, at, 0);
+  piece ins = { editorAddText(s, len), len };
+  editorRowInsertPieces(row, editorRowSplit(row, at), &ins, 1);
+  editorRowCompact(row);
+  editorUpdateRowEdit(row, &ed);
+  E.dirty++;
+}
+
+//cut the bytes [at, at + len) out of their pieces
+void editorRowDelText(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size) return;
+  rowedit ed;
+  editorRowBeginEdit(row, &ed, at, len);
+  int k = editorRowSplit(row, at);
+  int end = editorRowSplit(row, at + len);
+  piece *pc = editorRowPieces(row);
+  for (; k < end; k++)
+    pc[k].len = 0;
+  row->size -= len;
+  editorRowCompact(row);
+  editorUpdateRowEdit(row, &ed);
+  E.dirty++;
+}
+
+//del leftside character of cursor
+void editorDelChar() {
+  //cursor past EOF
+  if (E.cursor_y == E.numrows) return;
+  if (E.cursor_x == 0 && E.cursor_y == 0) return;
+  erow *row = editorRowAt(E.cursor_y);
+
+  if (E.cursor_x > 0) {
+    char ch = editorRowByteAt(row, E.cursor_x - 1);
+    editorUndoRecord(UNDO_DELETE, E.cursor_y, E.cursor_x - 1, &ch, 1);
+    editorRowDelChar(row, E.cursor_x - 1);
+    editorSyntaxRowChanged(E.cursor_y);
+    editorTrigramRowChanged(E.cursor_y, E.cursor_x - 1, E.cursor_x - 1);
+    editorSaveRowChanged(E.cursor_y);
+    E.cursor_x--;
+  } 
+  //deleting a line so move all current contents to above line
+  else {
+    erow *prev = editorRowAt(E.cursor_y - 1);
+    E.cursor_x = prev->size;
+    editorUndoRecord(UNDO_JOIN, E.cursor_y - 1, E.cursor_x, NULL, 0);
+    editorRowAppendPieces(prev, editorRowPieces(row), row->npieces);
+    editorDelRow(E.cursor_y);
+    E.cursor_y--;
+    editorSyntaxRowChanged(E.cursor_y);
+    editorTrigramRowChanged(E.cursor_y, E.cursor_x, prev->size);
+    editorSaveRowChanged(E.cursor_y);
+  }
+}
+
+/*** trigram index ***/
+//every leaf of the row tree carries a bitmap of the case-folded trigrams
+//in its rows; row numbers shift on every insert, leaves do not, so the
+//leaves play the part of posting list entries. Bits are only ever added
+//between rebuilds, which keeps a signature a superset of its trigrams.
+//case folding shared with the search kernel
+unsigned char searchfold[256];
+
+void editorSearchFoldInit() {
+  if (searchfold['A'] != 'a')
+    for (int c = 0; c < 256; c++)
+      searchfold[c] = tolower(c);
+}
+
+unsigned int editorTrigramHash(const char *t) {
+  unsigned int h = (searchfold[(unsigned char)t[0]] << 16) |
+                   (searchfold[(unsigned char)t[1]] << 8) |
+                    searchfold[(unsigned char)t[2]];
+  return (h * 2654435761u) >> 20;
+}
+
+//add the trigrams of text that overlap bytes [from, to)
+void editorTrigramAdd(rownode *leaf, const char *text, int len, int from, int to) {
+  int i = from > 2 ? from - 2 : 0;
+  for (; i < to && i + 3 <= len; i++) {
+    unsigned int h = editorTrigramHash(text + i);
+    leaf->tri[h >> 3] |= 1 << (h & 7);
+  }
+}
+
+void editorTrigramIndexLeaf(rownode *leaf) {
+  if (leaf->tri == NULL) leaf->tri = malloc(TRIGRAM_BITS / 8);
+  memset(leaf->tri, 0, TRIGRAM_BITS / 8);
+  leaf->tri_stale = 0;
+  for (int i = 0; i < leaf->n; i++) {
+    erow *row = &leaf->rows[i];
+    editorTrigramAdd(leaf, editorRowFlatten(row), row->size, 0, row->size);
+  }
+}
+
+//bytes [from, to) of row at are new; an empty range marks a deletion there,
+//whose joined neighbours are added and which counts towards a rebuild
+void editorTrigramRowChanged(int at, int from, int to) {
+  if (!E.tri_enabled || at < 0 || at >= E.numrows) return;
+  int i;
+  rownode *leaf = rowTreeFind(at, &i);
+  if (leaf->tri == NULL) return;
+  if (from == to && ++leaf->tri_stale > TRIGRAM_MAX_STALE) {
+    editorTrigramIndexLeaf(leaf);
+    return;
+  }
+  erow *row = &leaf->rows[i];
+  editorTrigramAdd(leaf, editorRowFlatten(row), row->size, from, to + 2);
+}
+
+//index leaves for a few milliseconds, called between keystrokes until the
+//whole file is covered
+void editorTrigramBuildStep() {
+  if (!E.tri_enabled || E.tri_next == NULL) return;
+  double start = editorNowMs();
+  while (E.tri_next && editorNowMs() - start < TRIGRAM_STEP_MS) {
+    if (E.tri_next->tri == NULL) editorTrigramIndexLeaf(E.tri_next);
+    E.tri_next = E.tri_next->next;
+  }
+}
+
+//after a file is loaded: index it in the background if it is large
+void editorTrigramStart() {
+  int i;
+  E.tri_enabled = E.numrows >= TRIGRAM_MIN_ROWS;
+  editorSearchFoldInit();
+  E.tri_next = E.tri_enabled ? rowTreeFind(0, &i) : NULL;
+}
+
+//rows of every leaf whose signature holds all trigrams of the n strings,
+//leaves not indexed yet always qualify; returns 0 when the index cannot
+//help
+int editorTrigramCandidates(char *const *queries, int n, searchlevel *out) {
+  int usable = 0;
+  for (int q = 0; q < n; q++)
+    if (strlen(queries[q]) >= 3) usable = 1;
+  if (!E.tri_enabled || !usable) return 0;
+  out->rows = malloc(sizeof(int) * (E.numrows ? E.numrows : 1));
+  out->n = 0;
+  int i;
+  int at = 0;
+  rownode *leaf;
+  for (leaf = rowTreeFind(0, &i); leaf; at += leaf->n, leaf = leaf->next) {
+    int hit = 1;
+    for (int q = 0; hit && leaf->tri && q < n; q++)
+      for (int j = 0; hit && queries[q][j] && queries[q][j + 1] &&
+                      queries[q][j + 2]; j++) {
+        unsigned int h = editorTrigramHash(queries[q] + j);
+        hit = (leaf->tri[h >> 3] >> (h & 7)) & 1;
+      }
+    for (int k = 0; hit && k < leaf->n; k++)
+      out->rows[out->n++] = at + k;
+  }
+  return 1;
+}
+
+/*** editor operations ***/
+//appends a new row before character insertion
+void editorInsertChar(int c) {
+  if (E.cursor_y == E.numrows) {
+    editorUndoRecord(UNDO_OPEN, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  char ch = c;
+  editorUndoRecord(UNDO_INSERT, E.cursor_y, E.cursor_x, &ch, 1);
+  editorRowInsertChar(editorRowAt(E.cursor_y), E.cursor_x, c);
+  editorSyntaxRowChanged(E.cursor_y);
+  editorTrigramRowChanged(E.cursor_y, E.cursor_x, E.cursor_x + 1);
+  editorSaveRowChanged(E.cursor_y);
+  E.cursor_x++;
+}
+
+//insert a run of bytes without newlines at the cursor, as one edit
+void editorInsertText(const char *s, int len) {
+  if (len <= 0) return;
+  if (E.cursor_y == E.numrows) {
+    editorUndoRecord(UNDO_OPEN, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorUndoRecord(UNDO_INSERT, E.cursor_y, E.cursor_x, s, len);
+  editorRowInsertText(editorRowAt(E.cursor_y), E.cursor_x, s, len);
+  editorSyntaxRowChanged(E.cursor_y);
+  editorTrigramRowChanged(E.cursor_y, E.cursor_x, E.cursor_x + len);
+  editorSaveRowChanged(E.cursor_y);
+  E.cursor_x += len;
+}
+
+//delete len bytes of the cursor's row from the cursor on
+void editorDeleteText(int len) {
+  if (E.cursor_y >= E.numrows) return;
+  erow *row = editorRowAt(E.cursor_y);
+  if (len > row->size - E.cursor_x) len = row->size - E.cursor_x;
+  if (len <= 0) return;
+  editorUndoRecord(UNDO_DELETE, E.cursor_y, E.cursor_x,
+    editorRowFlatten(row) + E.cursor_x, len);
+  editorRowDelText(row, E.cursor_x, len);
+  editorSyntaxRowChanged(E.cursor_y);
+  editorTrigramRowChanged(E.cursor_y, E.cursor_x, E.cursor_x);
+  editorSaveRowChanged(E.cursor_y);
+}
+
+void editorInsertNewline() {
+  editorUndoRecord(UNDO_SPLIT, E.cursor_y, E.cursor_x, NULL, 0);
+  //if beginning of line, insert new blank row above line
+  if (E.cursor_x == 0) {
+    editorInsertRow(E.cursor_y, "", 0);
+  } 
+  //split line into 2 rows
+  else {
+    //the pieces after the cursor move to the new row as they are
+    erow *row = editorRowAt(E.cursor_y);
+    int k = editorRowSplit(row, E.cursor_x);
+    rowedit ed;
+    editorRowBeginEdit(row, &ed, E.cursor_x, row->size - E.cursor_x);
+    piece *tail = &editorRowPieces(row)[k];
+    piece inl;
+    //an inline span moves with its row when the new slot opens
+    if (row->pieces == NULL) {
+      inl = row->span;
+      tail = &inl;
+    }
+    editorInsertRowPieces(E.cursor_y + 1, tail, row->npieces - k);
+    row = editorRowAt(E.cursor_y);
+    row->npieces = k;
+    row->size = E.cursor_x;
+    editorRowCompact(row);
+    editorUpdateRowEdit(row, &ed);
+    editorSyntaxRowChanged(E.cursor_y);
+    editorSaveRowChanged(E.cursor_y);
+  }
+  E.cursor_y++;
+  E.cursor_x = 0;
+}
+
+//insert pasted text as one edit: the cursor's row is split once, each
+//line goes in whole at the end of the row before the split, and the last
+//one at the start of the row after it, so the rest of the original line
+//is only moved once however many lines there are
+void editorInsertPaste(const char *s, size_t len) {
+  editorUndoGroup(1);
+  int split = 0;
+  size_t i = 0;
+  while (1) {
+    size_t j = i;
+    while (j < len && s[j] != '\r' && s[j] != '\n') j++;
+    if (j == len) break;
+    if (!split) {
+      int y = E.cursor_y, x = E.cursor_x;
+      if (y == E.numrows) {
+        editorUndoRecord(UNDO_OPEN, E.numrows, 0, NULL, 0);
+        editorInsertRow(E.numrows, "", 0);
+      }
+      editorInsertNewline();
+      E.cursor_y = y;
+      E.cursor_x = x;
+      split = 1;
+    } else {
+      editorInsertNewline();
+    }
+    editorInsertText(s + i, j - i);
+    //terminals send line breaks as \r, \n or \r\n
+    if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') j++;
+    i = j + 1;
+  }
+  if (split) {
+    E.cursor_y++;
+    E.cursor_x = 0;
+  }
+  editorInsertText(s + i, len - i);
+  editorUndoGroup(0);
+}
+
+
+/*** undo ***/
+//the record ending at offset end of the journal, and its text
+undorec editorUndoRecordBefore(size_t end, const char **text) {
+  struct editorUndo *u = &E.undo;
+  int size;
+  undorec rec;
+  memcpy(&size, u->buf + end - sizeof(int), sizeof(int));
+  memcpy(&rec, u->buf + end - size, sizeof(rec));
+  *text = (const char *)u->buf + end - size + sizeof(rec);
+  return rec;
+}
+
+//forget the oldest records until the journal is back under three
+//quarters of its cap, dropping it all if the newest alone is too big
+void editorUndoTrim() {
+  struct editorUndo *u = &E.undo;
+  size_t drop = 0;
+  while (drop < u->len && u->len - drop > u->max / 4 * 3) {
+    undorec rec;
+    memcpy(&rec, u->buf + drop, sizeof(rec));
+    drop += sizeof(rec) + rec.len + sizeof(int);
+  }
+  memmove(u->buf, u->buf + drop, u->len - drop);
+  u->len -= drop;
+  u->pos = u->pos > drop ? u->pos - drop : 0;
+}
+
+//room for n more bytes in the journal
+void editorUndoReserve(size_t n) {
+  struct editorUndo *u = &E.undo;
+  if (u->len + n > u->cap) {
+    u->cap = (u->len + n) * 2;
+    u->buf = realloc(u->buf, u->cap);
+  }
+}
+
+//note an edit, dropping whatever could have been redone; typing and
+//deleting a run of characters grows the last record instead of adding one
+void editorUndoRecord(int type, int y, int x, const char *text, int len) {
+  struct editorUndo *u = &E.undo;
+  //every edit, undone and redone ones too, goes to the crash journal
+  editorSwapRecord(type, y, x, text, len);
+  if (u->replaying) return;
+  u->len = u->pos;
+
+  if (u->len && !u->sealed && (type == UNDO_INSERT || type == UNDO_DELETE)) {
+    const char *old;
+    undorec last = editorUndoRecordBefore(u->len, &old);
+    int same = (last.type & ~UNDO_CHAINED) == type && last.y == y;
+    //typing and deleting forward add at the end, backspacing at the start
+    int append = same && (type == UNDO_INSERT ? last.x + last.len == x : last.x == x);
+    int prepend = same && type == UNDO_DELETE && x + len == last.x;
+    if (append || prepend) {
+      int size = sizeof(last) + last.len + sizeof(int);
+      size_t at = u->len - size;
+      editorUndoReserve(len);
+      unsigned char *t = u->buf + at + sizeof(last);
+      if (prepend) {
+        memmove(t + len, t, last.len);
+        memcpy(t, text, len);
+        last.x = x;
+      } else {
+        memcpy(t + last.len, text, len);
+      }
+      last.len += len;
+      size += len;
+      memcpy(u->buf + at, &last, sizeof(last));
+      memcpy(t + last.len, &size, sizeof(int));
+      u->len += len;
+      u->pos = u->len;
+      if (u->len > u->max)
+        editorUndoTrim();
+      return;
+    }
+  }
+  u->sealed = 0;
+
+  undorec rec = { type | (u->group > 1 ? UNDO_CHAINED : 0), y, x, len };
+  if (u->group) u->group++;
+  int size = sizeof(rec) + len + sizeof(int);
+  editorUndoReserve(size);
+  memcpy(u->buf + u->len, &rec, sizeof(rec));
+  if (len) memcpy(u->buf + u->len + sizeof(rec), text, len);
+  memcpy(u->buf + u->len + sizeof(rec) + len, &size, sizeof(int));
+  u->len += size;
+  u->pos = u->len;
+  if (u->len > u->max)
+    editorUndoTrim();
+}
+
+//make the edit a record describes, forward or backward, through the
+//ordinary editing operations so rendering, highlighting and search stay
+//in step
+void editorUndoApply(undorec rec, const char *text, int forward) {
+  int type = rec.type & ~UNDO_CHAINED;
+  if (!forward) {
+    static const int inverse[] = {
+      0, UNDO_DELETE, UNDO_INSERT, UNDO_JOIN, UNDO_SPLIT, UNDO_CLOSE, UNDO_OPEN
+    };
+    type = inverse[type];
+  }
+  E.cursor_y = rec.y;
+  E.cursor_x = rec.x;
+  switch (type) {
+    case UNDO_INSERT:
+      editorInsertText(text, rec.len);
+      break;
+    case UNDO_DELETE:
+      editorDeleteText(rec.len);
+      break;
+    case UNDO_SPLIT:
+      editorInsertNewline();
+      break;
+    case UNDO_JOIN:
+      E.cursor_y = rec.y + 1;
+      E.cursor_x = 0;
+      editorDelChar();
+      break;
+    case UNDO_OPEN:
+      editorUndoRecord(UNDO_OPEN, rec.y, 0, NULL, 0);
+      editorInsertRow(rec.y, "", 0);
+      break;
+    case UNDO_CLOSE:
+      editorUndoRecord(UNDO_CLOSE, rec.y, 0, NULL, 0);
+      editorDelRow(rec.y);
+      break;
+  }
+}
+
+void editorUndo() {
+  struct editorUndo *u = &E.undo;
+  if (u->pos == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  const char *text;
+  undorec rec;
+  u->replaying = 1;
+  do {
+    rec = editorUndoRecordBefore(u->pos, &text);
+    editorUndoApply(rec, text, 0);
+    u->pos -= sizeof(rec) + rec.len + sizeof(int);
+  } while ((rec.type & UNDO_CHAINED) && u->pos > 0);
+  u->replaying = 0;
+  u->sealed = 1;
+}
+
+void editorRedo() {
+  struct editorUndo *u = &E.undo;
+  if (u->pos == u->len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  undorec rec;
+  u->replaying = 1;
+  do {
+    memcpy(&rec, u->buf + u->pos, sizeof(rec));
+    editorUndoApply(rec, (const char *)u->buf + u->pos + sizeof(rec), 1);
+    u->pos += sizeof(rec) + rec.len + sizeof(int);
+    if (u->pos < u->len) memcpy(&rec, u->buf + u->pos, sizeof(rec));
+  } while (u->pos < u->len && (rec.type & UNDO_CHAINED));
+  u->replaying = 0;
+  u->sealed = 1;
+}
+
+//edits made between editorUndoGroup(1) and editorUndoGroup(0) are undone
+//and redone as one
+void editorUndoGroup(int on) {
+  E.undo.group = on;
+  E.undo.sealed = 1;
+}
+
+
+/*** file i/o  ***/
+//write n buffers in full, picking up after short writes
+int editorWritevAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+//the document's text from byte skip of row at onward as buffers for
+//writev, pointing into the mapping and the add buffer, which are never
+//written to while a snapshot is out (see editorAddPin); rows still in the
+//mapping take their newline from it, so runs of unedited rows merge into
+//one buffer
+struct iovec *editorSaveSnapshot(int at, int skip, int *niov, long long *bytes) {
+  static char newline = '\n';
+  int n = 0, cap = 64;
+  struct iovec *iov = malloc(sizeof(struct iovec) * cap);
+  *bytes = 0;
+  rowiter it;
+  erow *row;
+  for (row = editorRowIterStart(&it, at); row; row = editorRowIterNext(&it)) {
+    piece *pc = editorRowPieces(row);
+    for (int k = 0; k <= row->npieces; k++) {
+      const char *p = k < row->npieces ? pc[k].p : &newline;
+      size_t len = k < row->npieces ? (size_t)pc[k].len : 1;
+      //leave out the start of the first row, already in the file
+      if (skip && k < row->npieces) {
+        int drop = skip < (int)len ? skip : (int)len;
+        p += drop;
+        len -= drop;
+        skip -= drop;
+        if (len == 0) continue;
+      }
+      char *end = n ? (char *)iov[n - 1].iov_base + iov[n - 1].iov_len : NULL;
+      if (k == row->npieces && E.map && end >= E.map &&
+          end < E.map + E.maplen && *end == '\n')
+        p = end;
+      *bytes += len;
+      if (n && end == p) {
+        iov[n - 1].iov_len += len;
+        continue;
+      }
+      if (n == cap) {
+        cap *= 2;
+        iov = realloc(iov, sizeof(struct iovec) * cap);
+      }
+      iov[n].iov_base = (void *)p;
+      iov[n].iov_len = len;
+      n++;
+    }
+  }
+  *niov = n;
+  return iov;
+}
+
+
+//scan buf for newlines and collect the offset of every line start
+//with SSE2 this compares 64 bytes per iteration and walks the match mask
+size_t *editorIndexLines(const char *buf, size_t len, size_t *nlines) {
+  size_t cap = len / 64 + 16;
+  size_t n = 0;
+  size_t *off = malloc(cap * sizeof(size_t));
+  if (len > 0) off[n++] = 0;
+
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 64 <= len; i += 64) {
+    const __m128i *p = (const __m128i *)(buf + i);
+    unsigned long long mask =
+      (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), nl)) |
+      (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl)) << 16 |
+      (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl)) << 32 |
+      (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl)) << 48;
+    while (mask) {
+      size_t pos = i + __builtin_ctzll(mask) + 1;
+      if (n == cap) {
+        cap *= 2;
+        off = realloc(off, cap * sizeof(size_t));
+      }
+      off[n++] = pos;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if (buf[i] != '\n') continue;
+    if (n == cap) {
+      cap *= 2;
+      off = realloc(off, cap * sizeof(size_t));
+    }
+    off[n++] = i + 1;
+  }
+  //a trailing newline ends the last line rather than starting a new one
+  if (n > 0 && off[n - 1] == len) n--;
+  *nlines = n;
+  return off;
+}
+
+//map a regular file read-only into E.map
+int editorMapFile(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return -1;
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  E.map = map;
+  E.maplen = E.mapsame = st.st_size;
+  E.mapstat = st;
+  return 0;
+}
+
+void editorUnmapFile() {
+  if (E.map)
+    munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = E.mapsame = 0;
+}
+
+//append a row for each of the nlines lines of the mapping starting at the
+//offsets in off, the last one ending at byte last
+void editorLoadMappedLines(const size_t *off, size_t nlines, size_t last) {
+  size_t j;
+  E.map_exact = E.map[last - 1] == '\n';
+  for (j = 0; j < nlines; j++) {
+    size_t start = off[j];
+    size_t end = (j + 1 < nlines) ? off[j + 1] : last;
+    size_t next = end;
+    while (end > start && (E.map[end - 1] == '\n' || E.map[end - 1] == '\r'))
+      end--;
+    if (end + 1 < next)
+      E.map_exact = 0;
+    erow *row = editorRowSlot(E.numrows);
+    memset(row, 0, sizeof(erow));
+    editorRowSetSpan(row, E.map + start, end - start);
+  }
+}
+
+//build the row array straight from the mapping without copying any text
+void editorLoadMappedRows() {
+  double t = editorNowMs();
+  madvise(E.map, E.maplen, MADV_SEQUENTIAL);
+  size_t nlines;
+  size_t *off = editorIndexLines(E.map, E.maplen, &nlines);
+  madvise(E.map, E.maplen, MADV_NORMAL);
+  E.openstats.index_ms = editorNowMs() - t;
+
+  t = editorNowMs();
+  editorLoadMappedLines(off, nlines, E.maplen);
+  free(off);
+  E.openstats.rows_ms = editorNowMs() - t;
+}
+
+//fallback path for anything that cannot be mapped (empty files, pipes)
+void editorLoadStreamRows(FILE *fp) {
+  double t = editorNowMs();
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line); 
+  E.openstats.rows_ms = editorNowMs() - t;
+}
+
+//read from file if possible and output each line to editor
+//regular files are mapped and rows point into the mapping until edited,
+//set LITE_NO_MMAP to force the getline path for comparison
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntaxHighlight();
+
+  memset(&E.openstats, 0, sizeof(E.openstats));
+  double start = editorNowMs();
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  //a crash journal left for this version of the file is replayed onto
+  //it, starting from its base when it has one
+  struct stat st;
+  unsigned char *swap = NULL;
+  const unsigned char *records = NULL, *end = NULL;
+  long long large = getenv("LITE_LARGE_FILE") ? atoll(getenv("LITE_LARGE_FILE"))
+                                              : LARGE_FILE_BYTES;
+  int fstated = fstat(fd, &st) == 0;
+  E.large.on = fstated && S_ISREG(st.st_mode) && st.st_size > 0 &&
+               st.st_size >= large;
+  if (fstated && !E.large.on)
+    records = editorSwapRead(filename, &st, &swap, &end);
+  int mapped = !getenv("LITE_NO_MMAP") && editorMapFile(fd) == 0;
+  //a large file that can't be mapped is read whole after all
+  if (!mapped) E.large.on = 0;
+  const unsigned char *after = records ? editorSwapLoadBase(records, end, fd) : NULL;
+  if (records && after == NULL) {
+    //a base that can't be rebuilt from the file: open the file as it is
+    //and keep the journal
+    editorRowTreeFree(E.rows);
+    E.rows = rowNodeNew(1);
+    E.numrows = 0;
+    char *path = editorSwapPath(filename);
+    E.swap.aside = editorSwapAside(path);
+    free(path);
+    records = NULL;
+  }
+  int based = after != records;
+  records = after;
+
+  if (mapped) {
+    E.openstats.mapped = 1;
+    E.openstats.map_ms = editorNowMs() - start;
+    close(fd);
+    if (E.large.on)
+      editorLargeOpen();
+    else if (!based)
+      editorLoadMappedRows();
+  } else {
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+    if (!based)
+      editorLoadStreamRows(fp);
+    fclose(fp); 
+  }
+  E.openstats.total_ms = editorNowMs() - start;
+  editorTrigramStart();
+  //reset dirty flag
+  E.dirty = 0;
+  E.save_clean = E.map && E.map_exact && !based ? E.numrows : 0;
+  if (records) {
+    //a base alone already differs from the file
+    E.dirty = based;
+    E.swap.recovered = editorSwapReplay(&records, end) + based;
+  }
+  editorSwapStart(filename, E.swap.recovered ? records - swap : 0);
+  free(swap);
+}
+
+//fd now holds exactly the document, so point every row into a fresh
+//mapping of it as a single span and drop the add buffer and the old
+//mapping, or copy the rows into a new add buffer if it cannot be mapped
+void editorRemapRows(int fd) {
+  addblock *old = E.add;
+  char *oldmap = E.map;
+  size_t oldlen = E.maplen;
+  E.add = NULL;
+  E.addpin = NULL;
+  E.map = NULL;
+  E.maplen = E.mapsame = 0;
+  //the line indexer reads the old mapping
+  if (E.large.on) editorLargeIndexStop();
+  int mapped = editorMapFile(fd) == 0;
+  //a large file's window sits after the part of the file before it
+  size_t off = E.large.on ? E.large.start : 0;
+  rowiter it;
+  erow *row;
+  for (row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    int len = row->size;
+    if (mapped)
+      editorRowSetSpan(row, E.map + off, len);
+    else
+      editorRowSetSpan(row, editorAddText(editorRowFlatten(row), len), len);
+    off += len + 1;
+  }
+  if (oldmap)
+    munmap(oldmap, oldlen);
+  editorAddFree(old);
+  if (E.large.on) {
+    //without a mapping the rest of the file isn't reachable, and the
+    //next save would drop it
+    if (!mapped) die("mmap");
+    E.large.end = off < E.maplen ? off : E.maplen;
+    editorLargeIndexStart();
+  }
+  //the file was written from the rows, newline terminated
+  E.map_exact = 1;
+  E.save_clean = mapped ? E.numrows : 0;
+}
+
+//row at was edited, inserted or removed
+void editorSaveRowChanged(int at) {
+  if (at < E.save_clean)
+    E.save_clean = at;
+}
+
+//where a save to target can start rewriting it in place: the first byte
+//of the document that differs from the file, when the file is still the
+//one mapped and what follows is small next to it, or -1 to replace the
+//whole file; *at and *skip give the row and byte within it, *keep the
+//bytes at the end of the file that are not rewritten
+long long editorSavePartialStart(const char *target, int *at, int *skip,
+                                 long long *keep) {
+  struct stat st;
+  *keep = 0;
+  if (E.map == NULL || !E.map_exact || stat(target, &st) == -1 ||
+      st.st_dev != E.mapstat.st_dev || st.st_ino != E.mapstat.st_ino ||
+      st.st_size != E.mapstat.st_size ||
+      st.st_mtim.tv_sec != E.mapstat.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != E.mapstat.st_mtim.tv_nsec)
+    return -1;
+
+  //unedited rows sit at their own offset, so the one before the first
+  //edited row tells where it starts
+  int c = E.save_clean < E.numrows ? E.save_clean : E.numrows;
+  long long off = E.large.on ? (long long)E.large.start : 0;
+  if (c > 0) {
+    erow *prev = editorRowAt(c - 1);
+    off = prev->span.p - E.map + prev->size + 1;
+  }
+  long long limit = E.maplen / SAVE_PARTIAL_RATIO;
+  //after a large file's window the file stays where it is, as long as
+  //the window's text keeps its length
+  *keep = E.large.on ? (long long)(E.maplen - E.large.end) : 0;
+  if (*keep) limit = E.large.end - off;
+  long long tail = 0;
+  rowiter it;
+  erow *row;
+  for (row = editorRowIterStart(&it, c); row; row = editorRowIterNext(&it)) {
+    tail += row->size + 1;
+    if (tail > limit) return -1;
+  }
+  if (*keep && tail != limit) return -1;
+
+  //the edited row may still start the way it did
+  int same = 0;
+  if (c < E.numrows) {
+    row = editorRowAt(c);
+    const char *text = editorRowFlatten(row);
+    while (same < row->size && off + same < (long long)E.maplen &&
+           text[same] == E.map[off + same])
+      same++;
+  }
+  *at = c;
+  *skip = same;
+  return off + same;
+}
+
+//write the snapshot's buffers, SAVE_IOV per writev; a large file's are
+//written a share of the memory cap at a time, and what was read from the
+//mapping is dropped from memory after each
+int editorSaveWriteAll(int fd, struct iovec *iov, int niov) {
+  size_t most = E.large.on ? E.large.cap / 8 : (size_t)-1;
+  int i = 0;
+  while (i < niov) {
+    int n = 0;
+    size_t bytes = 0;
+    while (i + n < niov && n < SAVE_IOV && (n == 0 || bytes < most))
+      bytes += iov[i + n++].iov_len;
+    if (editorWritevAll(fd, &iov[i], n) == -1)
+      return -1;
+    for (; E.large.on && n > 0; n--, i++) {
+      char *p = iov[i].iov_base;
+      if (p >= E.map && p < E.map + E.maplen)
+        editorLargeRelease(p - E.map, p - E.map + iov[i].iov_len);
+    }
+    i += n;
+  }
+  return 0;
+}
+
+//write the snapshot over the target from job->offset and cut the file to
+//the new length; only the changed end of the file is written, at the cost
+//of a crash mid-write leaving that end half written
+int editorSaveInPlace(struct editorSaveJob *job) {
+  job->fd = open(job->target, O_RDWR);
+  if (job->fd == -1)
+    return -1;
+  if (lseek(job->fd, job->offset, SEEK_SET) == -1)
+    return -1;
+  if (editorSaveWriteAll(job->fd, job->iov, job->niov) == -1)
+    return -1;
+  if (ftruncate(job->fd, job->offset + job->bytes + job->keep) == -1 ||
+      fsync(job->fd) == -1)
+    return -1;
+  return 0;
+}
+
+//stream the snapshot into a temporary file beside the target, SAVE_IOV
+//buffers per writev, make it durable and rename it over the target, so a
+//crash at any point leaves either the old file or the new one
+int editorSaveReplace(struct editorSaveJob *job) {
+  char *tmp = malloc(strlen(job->target) + 8);
+  sprintf(tmp, "%s.XXXXXX", job->target);
+  int ret = -1;
+  job->fd = mkstemp(tmp);
+  if (job->fd != -1) {
+    //keep the target's permissions, or the usual ones for a new file
+    struct stat st;
+    mode_t mode;
+    if (stat(job->target, &st) == 0) {
+      mode = st.st_mode & 07777;
+    } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      mode = 0644 & ~mask;
+    }
+    int ok = fchmod(job->fd, mode) == 0 &&
+             editorSaveWriteAll(job->fd, job->iov, job->niov) == 0;
+    if (ok && fsync(job->fd) == 0 && rename(tmp, job->target) == 0) {
+      //make the rename itself durable
+      int dir = open(dirname(tmp), O_RDONLY);
+      if (dir != -1) {
+        fsync(dir);
+        close(dir);
+      }
+      ret = 0;
+    } else {
+      int err = errno;
+      unlink(tmp);
+      errno = err;
+    }
+  }
+  free(tmp);
+  return ret;
+}
+
+//writer thread
+void *editorSaveWorker(void *arg) {
+  struct editorSaveJob *job = arg;
+  job->fd = -1;
+  //rewriting the file in place waits for the journal to stop naming it
+  if (job->offset >= 0)
+    editorSwapWait();
+  int ret = job->offset >= 0 ? editorSaveInPlace(job) : editorSaveReplace(job);
+  job->err = ret == -1 ? errno : 0;
+  if (ret == -1 && job->fd != -1)
+    close(job->fd);
+  job->ms = editorNowMs() - job->start;
+  pthread_mutex_lock(&job->lock);
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  editorWake();
+  return NULL;
+}
+
+//snapshot the document and hand it to the writer thread, editing goes on
+//while it saves and editorSaveCollect reports the result
+void editorSave() {
+  struct editorSaveJob *job = &E.saving;
+  if (job->running) {
+    editorSetStatusMessage("Still saving, try again when it is done");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  job->start = editorNowMs();
+  job->target = realpath(E.filename, NULL);
+  if (job->target == NULL) job->target = strdup(E.filename);
+  int at = 0, skip = 0;
+  job->offset = editorSavePartialStart(job->target, &at, &skip, &job->keep);
+  //the line indexer reads the file through the mapping: rewritten in
+  //place it can change under it or shrink, and pages past the new end
+  //fault; editorRemapRows starts it again over the file as saved
+  if (job->offset >= 0 && E.large.on)
+    editorLargeIndexStop();
+  if (job->offset >= 0) {
+    //the rows from the first change on are about to be overwritten in
+    //the file under the mapping, copy them out of it first
+    rowiter it;
+    erow *row;
+    for (row = editorRowIterStart(&it, at); row; row = editorRowIterNext(&it))
+      editorRowSetSpan(row, editorAddText(editorRowFlatten(row), row->size), row->size);
+  }
+  job->iov = editorSaveSnapshot(at, skip, &job->niov, &job->bytes);
+  editorAddPin();
+  if (job->offset >= 0 && E.dirty)
+    editorSwapPrefix(job->offset);
+  if (E.large.on && job->offset < 0)
+    job->iov = editorLargeSnapshot(job->iov, &job->niov, &job->bytes);
+  job->dirty = E.dirty;
+  job->done = 0;
+  job->running = 1;
+  if (pthread_create(&job->thread, NULL, editorSaveWorker, job) != 0) {
+    job->running = 0;
+    free(job->target);
+    free(job->iov);
+    editorSetStatusMessage("Can't save! %s", strerror(errno));
+    return;
+  }
+  editorSetStatusMessage("Saving %lld bytes...", job->bytes);
+}
+
+//the file was written but doesn't hold the document: edits came in during
+//the save, or an in-place write failed partway. The mapping stays as it
+//was and no longer is the file: a replaced file is still mapped whole
+//from the old inode, a file rewritten in place from offset on was cut
+//under it, and only the bytes before offset (and a large file's keep
+//bytes after its window, rewritten at their own length) can still be
+//read. The rows only point there, the ones after offset were copied out,
+//but the next save can no longer rewrite just its end
+void editorSaveStale(struct editorSaveJob *job) {
+  E.map_exact = 0;
+  E.save_clean = 0;
+  //the journal names the file as it was, which is gone or rewritten:
+  //start it again against the file as it is now, from a base holding the
+  //document
+  if (job->offset < 0) E.mapsame = 0;
+  else if ((size_t)job->offset < E.mapsame) E.mapsame = job->offset;
+  editorSwapReset();
+  if (editorSwapThread()) editorSwapCompact();
+}
+
+//finish a background save once the writer is done, or waiting for it:
+//when nothing was edited since the snapshot the file holds the document,
+//so clear dirty and point the rows into it; returns whether a save
+//finished
+int editorSaveCollect(int wait) {
+  struct editorSaveJob *job = &E.saving;
+  if (!job->running) return 0;
+  pthread_mutex_lock(&job->lock);
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+  if (!done && !wait) return 0;
+
+  pthread_join(job->thread, NULL);
+  job->running = 0;
+  free(job->target);
+  free(job->iov);
+  if (job->err && job->offset >= 0) {
+    //the write may have stopped partway, leaving the file's end half old
+    //and half new
+    editorSaveStale(job);
+    editorSetStatusMessage("Can't save! %s, the file may be partly written",
+      strerror(job->err));
+    return 1;
+  }
+  if (job->err) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    return 1;
+  }
+  if (E.dirty == job->dirty) {
+    //the writer may still be reading the mapping for a base
+    editorSwapReset();
+    editorRemapRows(job->fd);
+    //changes have been saved 
+    E.dirty = 0;
+  } else {
+    editorSaveStale(job);
+  }
+  close(job->fd);
+  if (job->offset >= 0)
+    editorSetStatusMessage("%lld bytes written to disk at byte %lld in %.1f ms (%.1f MB/s)",
+      job->bytes, job->offset, job->ms, job->ms > 0 ? job->bytes / 1e3 / job->ms : 0.0);
+  else
+    editorSetStatusMessage("%lld bytes written to disk in %.1f ms (%.1f MB/s)",
+      job->bytes, job->ms, job->ms > 0 ? job->bytes / 1e3 / job->ms : 0.0);
+  return 1;
+}
+
+
+
+/*** large files ***/
+//drop the mapping's pages in [from, to) from memory, they are read back
+//from the file if they are needed again
+void editorLargeRelease(size_t from, size_t to) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t a = (from + page - 1) / page * page;
+  size_t b = to / page * page;
+  if (b > a) madvise(E.map + a, b - a, MADV_DONTNEED);
+}
+
+//indexing thread: goes on from the last line in the index to the end of
+//the file a megabyte at a time, letting go of each once it is counted
+void *editorLargeIndexer(void *arg) {
+  struct editorLarge *lg = arg;
+  size_t found[(1 << 20) / LARGE_INDEX_STRIDE + 1];
+  pthread_mutex_lock(&lg->lock);
+  size_t off = lg->index[lg->nindex - 1];
+  long long lines = (lg->nindex - 1) * LARGE_INDEX_STRIDE;
+  pthread_mutex_unlock(&lg->lock);
+  const char *map = E.map;
+  size_t len = E.maplen;
+  int stopped = 0;
+
+  while (off < len && !stopped) {
+    size_t stop = len - off > (1 << 20) ? off + (1 << 20) : len;
+    int n = 0;
+    const char *p = map + off;
+    while ((p = memchr(p, '\n', map + stop - p)) != NULL) {
+      p++;
+      lines++;
+      if (lines % LARGE_INDEX_STRIDE == 0 && p < map + len)
+        found[n++] = p - map;
+    }
+    pthread_mutex_lock(&lg->lock);
+    if (lg->nindex + n > lg->indexcap) {
+      lg->indexcap = (lg->nindex + n) * 2;
+      lg->index = realloc(lg->index, sizeof(size_t) * lg->indexcap);
+    }
+    memcpy(lg->index + lg->nindex, found, sizeof(size_t) * n);
+    lg->nindex += n;
+    lg->lines = lines;
+    stopped = lg->stop;
+    pthread_mutex_unlock(&lg->lock);
+    editorLargeRelease(off, stop);
+    off = stop;
+  }
+
+  pthread_mutex_lock(&lg->lock);
+  if (!stopped) {
+    //a last line without a newline counts too
+    lg->lines = lines + (map[len - 1] != '\n');
+    lg->indexed = 1;
+  }
+  pthread_mutex_unlock(&lg->lock);
+  editorWake();
+  return NULL;
+}
+
+//(re)start indexing after the last indexed line before the window, the
+//part of the file before it being as it was
+void editorLargeIndexStart() {
+  struct editorLarge *lg = &E.large;
+  while (lg->nindex > 1 && lg->index[lg->nindex - 1] > lg->start)
+    lg->nindex--;
+  lg->lines = (lg->nindex - 1) * LARGE_INDEX_STRIDE;
+  lg->indexed = 0;
+  lg->stop = 0;
+  lg->running = pthread_create(&lg->thread, NULL, editorLargeIndexer, lg) == 0;
+}
+
+void editorLargeIndexStop() {
+  struct editorLarge *lg = &E.large;
+  if (!lg->running) return;
+  pthread_mutex_lock(&lg->lock);
+  lg->stop = 1;
+  pthread_mutex_unlock(&lg->lock);
+  pthread_join(lg->thread, NULL);
+  lg->running = 0;
+}
+
+//where line (from 0) starts, scanning on from the nearest indexed line
+//before it, or the last line's start when the file is shorter; its
+//number in *at
+size_t editorLargeSeek(long long line, long long *at) {
+  struct editorLarge *lg = &E.large;
+  pthread_mutex_lock(&lg->lock);
+  long long k = line / LARGE_INDEX_STRIDE;
+  if (k >= lg->nindex) k = lg->nindex - 1;
+  size_t off = lg->index[k];
+  pthread_mutex_unlock(&lg->lock);
+
+  size_t from = off;
+  *at = k * LARGE_INDEX_STRIDE;
+  while (*at < line) {
+    const char *nl = memchr(E.map + off, '\n', E.maplen - off);
+    if (nl == NULL || nl + 1 == E.map + E.maplen) break;
+    off = nl + 1 - E.map;
+    (*at)++;
+    if (off - from >= 1 << 20) {
+      editorLargeRelease(from, off);
+      from = off;
+    }
+  }
+  return off;
+}
+
+void editorRowTreeFree(rownode *node) {
+  int k;
+  if (node->leaf) {
+    for (k = 0; k < node->n; k++)
+      editorFreeRow(&node->rows[k]);
+    free(node->rows);
+  } else {
+    for (k = 0; k < node->n; k++)
+      editorRowTreeFree(node->kids[k]);
+  }
+  free(node->tri);
+  free(node);
+}
+
+//replace the rows with the window starting at byte start, line number
+//line: whole lines, up to a quarter of the memory cap of text and a
+//quarter of it in rows, leaving room for saving and searching. Row
+//numbers then count from the new first line, so the cursor and viewport
+//shift with them
+void editorLargeLoad(size_t start, long long line) {
+  struct editorLarge *lg = &E.large;
+  double t = editorNowMs();
+  size_t end = E.maplen - start > lg->cap / 4 ? start + lg->cap / 4 : E.maplen;
+  if (end < E.maplen) {
+    //a line longer than the window is loaded whole
+    const char *nl = memrchr(E.map + start, '\n', end - start);
+    if (nl == NULL) nl = memchr(E.map + end, '\n', E.maplen - end);
+    end = nl ? (size_t)(nl + 1 - E.map) : E.maplen;
+  }
+  size_t nlines;
+  size_t *off = editorIndexLines(E.map + start, end - start, &nlines);
+  size_t maxrows = lg->cap / 4 / sizeof(erow);
+  if (nlines > maxrows) {
+    editorLargeRelease(start + off[maxrows], end);
+    end = start + off[maxrows];
+    nlines = maxrows;
+  }
+  for (size_t j = 0; j < nlines; j++)
+    off[j] += start;
+  E.openstats.index_ms = editorNowMs() - t;
+
+  t = editorNowMs();
+  editorRowTreeFree(E.rows);
+  E.rows = rowNodeNew(1);
+  E.numrows = 0;
+  editorLoadMappedLines(off, nlines, end);
+  free(off);
+  E.openstats.rows_ms = editorNowMs() - t;
+
+  //let go of what the old window held that the new one doesn't
+  if (lg->start < start)
+    editorLargeRelease(lg->start, lg->end < start ? lg->end : start);
+  if (lg->end > end)
+    editorLargeRelease(lg->start > end ? lg->start : end, lg->end);
+  long long shift = line - lg->line;
+  lg->start = start;
+  lg->end = end;
+  lg->line = line;
+
+  E.cursor_y -= shift;
+  E.rowoffset -= shift;
+  E.screen.rowoffset -= shift;
+  if (E.rowoffset < 0) E.rowoffset = 0;
+  E.hl_frontier = 0;
+  E.hl_gen++;
+  editorSearchDropLevels(0);
+  //undo records name rows of the old window
+  E.undo.len = E.undo.pos = 0;
+  E.save_clean = E.map_exact ? E.numrows : 0;
+  editorTrigramStart();
+}
+
+//load the window around line at, which starts at byte off, unless it is
+//there already: it starts up to half the window's bytes and rows before
+void editorLargeCenter(size_t off, long long at) {
+  size_t limit = off > E.large.cap / 8 ? off - E.large.cap / 8 : 0;
+  long long back = E.large.cap / 8 / sizeof(erow);
+  size_t start = off;
+  while (back-- > 0 && start > 0) {
+    const char *nl = start - 1 > limit ?
+      memrchr(E.map + limit, '\n', start - 1 - limit) : NULL;
+    if (nl) start = nl + 1 - E.map;
+    else if (limit == 0) start = 0;
+    else break;
+    at--;
+  }
+  if (start != E.large.start)
+    editorLargeLoad(start, at);
+}
+
+//the window can only move while its rows hold no unsaved edits and no
+//save is reading them; otherwise say why it stays
+int editorLargeCanMove() {
+  if (E.dirty == 0 && !E.saving.running) return 1;
+  editorSetStatusMessage(E.saving.running ?
+    "Saving, only the loaded lines can be reached until it is done" :
+    "Save first, only the loaded lines can be reached with unsaved edits");
+  return 0;
+}
+
+//keep the window around the cursor: once it nears either end of the
+//window, and the file goes on past that end, load the window again
+void editorLargeFollow() {
+  struct editorLarge *lg = &E.large;
+  if (!lg->on) return;
+  int margin = E.screen_rows * 2;
+  int up = E.cursor_y < margin && lg->start > 0;
+  int down = E.cursor_y >= E.numrows - margin && lg->end < E.maplen;
+  if (!up && !down) return;
+  //near the edge the window just waits; at it, tell why it went no further
+  if (E.dirty || E.saving.running) {
+    if ((up && E.cursor_y == 0) || (down && E.cursor_y >= E.numrows - 1))
+      editorLargeCanMove();
+    return;
+  }
+  int y = E.cursor_y < E.numrows ? E.cursor_y : E.numrows - 1;
+  editorLargeCenter(editorRowAt(y)->span.p - E.map, lg->line + y);
+}
+
+//move the cursor to line (from 0) of the file
+void editorLargeGoto(long long line) {
+  struct editorLarge *lg = &E.large;
+  if (line >= lg->line && line < lg->line + E.numrows) {
+    E.cursor_y = line - lg->line;
+    return;
+  }
+  if (!editorLargeCanMove()) return;
+  long long at;
+  size_t off = editorLargeSeek(line, &at);
+  editorLargeCenter(off, at);
+  E.cursor_y = at - lg->line;
+}
+
+//a save that replaces a large file writes the file before the window, the
+//window's rows in iov and the file after it, read from the mapping in
+//pieces a share of the memory cap long
+struct iovec *editorLargeSnapshot(struct iovec *iov, int *niov, long long *bytes) {
+  struct editorLarge *lg = &E.large;
+  size_t piece = lg->cap / 8;
+  int before = (lg->start + piece - 1) / piece;
+  int after = (E.maplen - lg->end + piece - 1) / piece;
+  iov = realloc(iov, sizeof(struct iovec) * (*niov + before + after));
+  memmove(iov + before, iov, sizeof(struct iovec) * *niov);
+  for (int k = 0; k < before; k++) {
+    iov[k].iov_base = E.map + k * piece;
+    iov[k].iov_len = lg->start - k * piece < piece ? lg->start - k * piece : piece;
+  }
+  for (int k = 0; k < after; k++) {
+    size_t at = lg->end + k * piece;
+    iov[before + *niov + k].iov_base = E.map + at;
+    iov[before + *niov + k].iov_len = E.maplen - at < piece ? E.maplen - at : piece;
+  }
+  *niov += before + after;
+  *bytes += lg->start + (E.maplen - lg->end);
+  return iov;
+}
+
+//a large file's first window, with the rest indexed in the background
+void editorLargeOpen() {
+  struct editorLarge *lg = &E.large;
+  lg->cap = getenv("LITE_MEM_CAP") ? strtoull(getenv("LITE_MEM_CAP"), NULL, 10)
+                                   : LARGE_MEM_CAP;
+  if (lg->cap < (1 << 20)) lg->cap = 1 << 20;
+  pthread_mutex_init(&lg->lock, NULL);
+  lg->indexcap = 64;
+  lg->index = malloc(sizeof(size_t) * lg->indexcap);
+  lg->index[0] = 0;
+  lg->nindex = 1;
+  editorLargeLoad(0, 0);
+  editorLargeIndexStart();
+}
+
+//the first row's line number in the file
+long long editorFirstLine() {
+  return E.large.on ? E.large.line : 0;
+}
+
+//the file's line count for the status bar, with a + while a large file
+//is still being counted
+void editorLineCount(char *buf, int size) {
+  struct editorLarge *lg = &E.large;
+  if (!lg->on) {
+    snprintf(buf, size, "%d", E.numrows);
+    return;
+  }
+  pthread_mutex_lock(&lg->lock);
+  long long lines = lg->lines;
+  int indexed = lg->indexed;
+  pthread_mutex_unlock(&lg->lock);
+  if (lines < lg->line + E.numrows) lines = lg->line + E.numrows;
+  snprintf(buf, size, "%lld%s", lines, indexed ? "" : "+");
+}
+
+
+/*** crash journal ***/
+int editorSwapPutVarint(unsigned char *buf, unsigned long long v) {
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  return n;
+}
+
+//the varint at p, or NULL when it runs past end
+const unsigned char *editorSwapGetVarint(const unsigned char *p,
+                                         const unsigned char *end,
+                                         unsigned long long *v) {
+  *v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    unsigned char b = *p++;
+    *v |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return p;
+  }
+  return NULL;
+}
+
+//magic and the identity of the file the journal replays onto, with its
+//own magic when it only names the file's start (editorSwapPrefix)
+int editorSwapHeader(unsigned char *buf, const unsigned long long *id, int prefix) {
+  memcpy(buf, prefix ? "LITESWPP" : "LITESWP1", 8);
+  int n = 8;
+  for (int i = 0; i < 4; i++)
+    n += editorSwapPutVarint(buf + n, id[i]);
+  return n;
+}
+
+void editorSwapIdentity(const struct stat *st, unsigned long long *id) {
+  id[0] = st->st_size;
+  id[1] = st->st_mtim.tv_sec;
+  id[2] = st->st_mtim.tv_nsec;
+  id[3] = st->st_ino;
+}
+
+//.name.swp in the file's directory
+char *editorSwapPath(const char *filename) {
+  char *dir = strdup(filename), *base = strdup(filename);
+  char *d = dirname(dir), *b = basename(base);
+  char *path = malloc(strlen(d) + strlen(b) + 7);
+  sprintf(path, "%s/.%s.swp", d, b);
+  free(dir);
+  free(base);
+  return path;
+}
+
+//move a journal that doesn't belong to the file as it is now out of the
+//way, to the first free path.N, rather than ever writing over it;
+//returns N, or 0 when it couldn't
+int editorSwapAside(const char *path) {
+  char *aside = malloc(strlen(path) + 12);
+  struct stat st;
+  int k;
+  for (k = 1; k < 1000; k++) {
+    sprintf(aside, "%s.%d", path, k);
+    if (lstat(aside, &st) == -1 && errno == ENOENT)
+      break;
+  }
+  if (k == 1000 || rename(path, aside) == -1)
+    k = 0;
+  free(aside);
+  return k;
+}
+
+//the journal left for filename if it belongs to this version of the file,
+//read whole into *buf; returns where its base or records start. One left
+//by a crash during an in-place save names only the start of the file the
+//save kept and its inode. A journal that belongs to some other version
+//is moved aside and E.swap.aside set
+const unsigned char *editorSwapRead(const char *filename, const struct stat *st,
+                                    unsigned char **buf, const unsigned char **end) {
+  char *path = editorSwapPath(filename);
+  int fd = open(path, O_RDONLY);
+  struct stat js;
+  if (fd == -1) {
+    free(path);
+    return NULL;
+  }
+  if (fstat(fd, &js) == -1 || js.st_size < 8) {
+    close(fd);
+    free(path);
+    return NULL;
+  }
+  *buf = malloc(js.st_size);
+  ssize_t n = read(fd, *buf, js.st_size);
+  close(fd);
+  unsigned long long id[4], v[4];
+  unsigned char header[48];
+  editorSwapIdentity(st, id);
+  int hlen = editorSwapHeader(header, id, 0);
+  const unsigned char *p = NULL;
+  if (n >= hlen && !memcmp(*buf, header, hlen)) {
+    p = *buf + hlen;
+  } else if (n >= 8 && !memcmp(*buf, "LITESWPP", 8)) {
+    p = *buf + 8;
+    for (int i = 0; p && i < 4; i++)
+      p = editorSwapGetVarint(p, *buf + n, &v[i]);
+    if (p && (v[3] != id[3] || v[0] > id[0]))
+      p = NULL;
+  }
+  if (p == NULL) {
+    free(*buf);
+    *buf = NULL;
+    E.swap.aside = editorSwapAside(path);
+  } else {
+    *end = *buf + n;
+  }
+  free(path);
+  return p;
+}
+
+//rebuild the rows from the journal's base, splitting its runs of the
+//file (from the mapping, or read from fd when there is none) and literal
+//text at newlines; returns where the records after it start, p itself
+//when there is no base, NULL when it can't be rebuilt
+const unsigned char *editorSwapLoadBase(const unsigned char *p, const unsigned char *end,
+                                        int fd) {
+  piece *pcs = NULL;
+  int n = 0, cap = 0, failed = 0;
+  while (p < end && (*p == SWAP_COPY || *p == SWAP_TEXT)) {
+    const unsigned char *q = p + 1;
+    unsigned long long off = 0, len;
+    if (*p == SWAP_COPY) q = editorSwapGetVarint(q, end, &off);
+    if (q) q = editorSwapGetVarint(q, end, &len);
+    failed = q == NULL || len > INT_MAX;
+    if (failed) break;
+    const char *src;
+    if (*p == SWAP_COPY && E.map) {
+      failed = off + len > E.maplen;
+      if (failed) break;
+      src = E.map + off;
+    } else if (*p == SWAP_COPY) {
+      char *buf = malloc(len ? len : 1);
+      failed = pread(fd, buf, len, off) != (ssize_t)len;
+      src = failed ? NULL : editorAddText(buf, len);
+      free(buf);
+      if (failed) break;
+    } else {
+      failed = len > (unsigned long long)(end - q);
+      if (failed) break;
+      src = editorAddText((const char *)q, len);
+      q += len;
+    }
+    p = q;
+    while (len) {
+      const char *nl = memchr(src, '\n', len);
+      size_t part = nl ? (size_t)(nl - src) : len;
+      if (part) {
+        if (n == cap) {
+          cap = cap ? cap * 2 : 16;
+          pcs = realloc(pcs, sizeof(piece) * cap);
+        }
+        pcs[n++] = (piece){ src, part };
+      }
+      if (!nl) break;
+      erow *row = editorRowSlot(E.numrows);
+      memset(row, 0, sizeof(erow));
+      editorRowInsertPieces(row, 0, pcs, n);
+      n = 0;
+      src = nl + 1;
+      len -= part + 1;
+    }
+  }
+  free(pcs);
+  return failed ? NULL : p;
+}
+
+//apply the edit records from *p on, stopping at anything that doesn't fit
+//the document (a record cut short by the crash) and leaving *p there;
+//returns how many applied
+int editorSwapReplay(const unsigned char **at, const unsigned char *end) {
+  const unsigned char *p = *at;
+  int applied = 0;
+  while (p < end) {
+    unsigned long long v[3];
+    int type = *p;
+    const unsigned char *q = p + 1;
+    for (int i = 0; q && i < 3; i++)
+      q = editorSwapGetVarint(q, end, &v[i]);
+    if (q == NULL || v[2] > (unsigned long long)(end - q) ||
+        v[0] > (unsigned long long)E.numrows || v[1] > INT_MAX || v[2] > INT_MAX)
+      break;
+    undorec rec = { type, v[0], v[1], v[2] };
+    erow *row = rec.y < E.numrows ? editorRowAt(rec.y) : NULL;
+    int size = row ? row->size : 0;
+    int ok;
+    switch (type) {
+      case UNDO_INSERT: ok = rec.x <= size && rec.len > 0; break;
+      case UNDO_DELETE: ok = row && rec.x + rec.len <= size && rec.len > 0; break;
+      case UNDO_SPLIT: ok = rec.x <= size && (row || rec.x == 0); break;
+      case UNDO_JOIN: ok = rec.y + 1 < E.numrows && rec.x == size; break;
+      case UNDO_OPEN: ok = 1; break;
+      case UNDO_CLOSE: ok = row && size == 0; break;
+      default: ok = 0;
+    }
+    if (!ok) break;
+    editorUndoApply(rec, (const char *)q, 1);
+    p = q + rec.len;
+    applied++;
+  }
+  E.cursor_x = E.cursor_y = 0;
+  *at = p;
+  return applied;
+}
+
+//write the base runs for the snapshot iov to fd, mapped text as offsets
+//into the file and everything else literally
+int editorSwapWriteBase(int fd, struct iovec *base, int nbase,
+                        const char *map, size_t maplen) {
+  struct iovec iov[SAVE_IOV];
+  unsigned char head[SAVE_IOV][24];
+  int n = 0;
+  for (int i = 0; i < nbase; i++) {
+    const char *p = base[i].iov_base;
+    int copy = map && p >= map && p + base[i].iov_len <= map + maplen;
+    unsigned char *h = head[n];
+    int hl = 0;
+    h[hl++] = copy ? SWAP_COPY : SWAP_TEXT;
+    if (copy) hl += editorSwapPutVarint(h + hl, p - map);
+    hl += editorSwapPutVarint(h + hl, base[i].iov_len);
+    iov[n].iov_base = h;
+    iov[n++].iov_len = hl;
+    if (!copy) iov[n++] = base[i];
+    if (n >= SAVE_IOV - 1 || i == nbase - 1) {
+      if (editorWritevAll(fd, iov, n) == -1) return -1;
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+//restart the journal from a base: write it beside the journal and
+//rename it over, so a crash leaves the old journal or the new one
+void editorSwapCompactFile(struct editorSwap *sw, struct iovec *base, int nbase) {
+  char *tmp = malloc(strlen(sw->path) + 5);
+  sprintf(tmp, "%s.new", sw->path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  unsigned char header[48];
+  int hlen = editorSwapHeader(header, sw->id, sw->prefix);
+  if (fd != -1 && write(fd, header, hlen) == hlen &&
+      editorSwapWriteBase(fd, base, nbase, sw->map, sw->maplen) == 0 &&
+      fdatasync(fd) == 0 && rename(tmp, sw->path) == 0) {
+    if (sw->fd != -1) close(sw->fd);
+    sw->fd = fd;
+  } else if (fd != -1) {
+    close(fd);
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+//writer thread: take everything queued, append it and sync it in one go
+void *editorSwapWriter(void *arg) {
+  struct editorSwap *sw = arg;
+  unsigned char *buf = NULL;
+  size_t cap = 0;
+  pthread_mutex_lock(&sw->lock);
+  while (1) {
+    while (!sw->stop && sw->len == 0 && sw->base == NULL) {
+      sw->busy = 0;
+      pthread_cond_broadcast(&sw->idle);
+      pthread_cond_wait(&sw->wake, &sw->lock);
+    }
+    if (sw->stop && sw->len == 0 && sw->base == NULL) break;
+    sw->busy = 1;
+    unsigned char *batch = sw->pending;
+    size_t n = sw->len, batchcap = sw->cap;
+    sw->pending = buf;
+    sw->cap = cap;
+    sw->len = 0;
+    buf = batch;
+    cap = batchcap;
+    struct iovec *base = sw->base;
+    int nbase = sw->nbase;
+    sw->base = NULL;
+    pthread_mutex_unlock(&sw->lock);
+
+    if (base) {
+      editorSwapCompactFile(sw, base, nbase);
+      free(base);
+    }
+    if (sw->fd == -1) {
+      //a journal already there isn't this one, it is kept
+      sw->fd = open(sw->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      if (sw->fd == -1 && errno == EEXIST && editorSwapAside(sw->path))
+        sw->fd = open(sw->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      unsigned char header[48];
+      int hlen = editorSwapHeader(header, sw->id, sw->prefix);
+      if (sw->fd != -1 && write(sw->fd, header, hlen) != hlen) {
+        close(sw->fd);
+        sw->fd = -1;
+      }
+    }
+    if (sw->fd != -1) {
+      struct iovec iov = { buf, n };
+      if (n == 0 || editorWritevAll(sw->fd, &iov, 1) == 0)
+        fdatasync(sw->fd);
+    }
+    pthread_mutex_lock(&sw->lock);
+  }
+  sw->busy = 0;
+  pthread_cond_broadcast(&sw->idle);
+  pthread_mutex_unlock(&sw->lock);
+  free(buf);
+  return NULL;
+}
+
+//journal edits to filename from now on, against the file as it is now;
+//a journal just replayed is carried on from its first keep bytes
+void editorSwapStart(const char *filename, off_t keep) {
+  struct editorSwap *sw = &E.swap;
+  struct stat st;
+  sw->fd = -1;
+  //records give rows from the top of the file, a large file's window
+  //doesn't start there
+  if (E.large.on) return;
+  free(sw->path);
+  sw->path = editorSwapPath(filename);
+  sw->size = sw->basesize = 0;
+  sw->prefix = 0;
+  sw->enabled = stat(filename, &st) == 0;
+  if (sw->enabled)
+    editorSwapIdentity(&st, sw->id);
+  if (sw->enabled && keep > 0) {
+    sw->fd = open(sw->path, O_WRONLY | O_APPEND);
+    if (sw->fd != -1 && ftruncate(sw->fd, keep) == -1) {
+      close(sw->fd);
+      sw->fd = -1;
+    }
+    sw->size = keep;
+  }
+}
+
+//block until the writer has written everything queued
+void editorSwapWait() {
+  struct editorSwap *sw = &E.swap;
+  if (!sw->started) return;
+  pthread_mutex_lock(&sw->lock);
+  while (sw->busy || sw->len || sw->base)
+    pthread_cond_wait(&sw->idle, &sw->lock);
+  pthread_mutex_unlock(&sw->lock);
+}
+
+//throw the journal away
+void editorSwapRemove() {
+  struct editorSwap *sw = &E.swap;
+  editorSwapWait();
+  if (sw->fd != -1) {
+    close(sw->fd);
+    sw->fd = -1;
+  }
+  if (sw->path)
+    unlink(sw->path);
+}
+
+//the file now holds the document: drop the journal and start a new one
+//against the file as saved
+void editorSwapReset() {
+  editorSwapRemove();
+  editorSwapStart(E.filename, 0);
+}
+
+//rewrite the journal as a base rebuilding the document as it is now,
+//the records queued so far are part of it; text is taken from the file
+//only where the mapping still matches it
+void editorSwapCompact() {
+  struct editorSwap *sw = &E.swap;
+  int nbase;
+  long long bytes;
+  struct iovec *base = editorSaveSnapshot(0, 0, &nbase, &bytes);
+  //the writer copies the base's literal runs out of the add buffer while
+  //editing goes on
+  editorAddPin();
+  size_t literal = 0;
+  for (int i = 0; i < nbase; i++) {
+    const char *p = base[i].iov_base;
+    if (!E.map || p < E.map || p + base[i].iov_len > E.map + E.mapsame)
+      literal += base[i].iov_len;
+  }
+  pthread_mutex_lock(&sw->lock);
+  free(sw->base);
+  sw->base = base;
+  sw->nbase = nbase;
+  sw->map = E.map;
+  sw->maplen = E.mapsame;
+  sw->len = 0;
+  pthread_cond_signal(&sw->wake);
+  pthread_mutex_unlock(&sw->lock);
+  sw->size = 0;
+  sw->basesize = literal;
+}
+
+//an in-place save is about to rewrite the file from offset on, after
+//which the journal's header no longer names it: restart the journal from
+//a base that reads only the file's first offset bytes, named by those
+//and the inode alone, so a crash mid-write still finds it and replays it
+//onto what the save left. The save waits for the base to be on disk
+void editorSwapPrefix(off_t offset) {
+  struct editorSwap *sw = &E.swap;
+  if (!editorSwapThread()) return;
+  //the writer reads the identity when it writes a header
+  editorSwapWait();
+  sw->prefix = 1;
+  sw->id[0] = offset;
+  sw->id[1] = sw->id[2] = 0;
+  if ((size_t)offset < E.mapsame) E.mapsame = offset;
+  editorSwapCompact();
+}
+
+//start the journal's writer thread if it isn't running; whether the
+//journal is on
+int editorSwapThread() {
+  struct editorSwap *sw = &E.swap;
+  if (!sw->enabled || sw->started) return sw->enabled;
+  pthread_mutex_init(&sw->lock, NULL);
+  pthread_cond_init(&sw->wake, NULL);
+  pthread_cond_init(&sw->idle, NULL);
+  if (pthread_create(&sw->thread, NULL, editorSwapWriter, sw) != 0) {
+    sw->enabled = 0;
+    return 0;
+  }
+  sw->started = 1;
+  return 1;
+}
+
+//queue an edit for the journal: its type, row, column and text
+void editorSwapRecord(int type, int y, int x, const char *text, int len) {
+  struct editorSwap *sw = &E.swap;
+  if (!editorSwapThread()) return;
+  //records come before the edit is made, so a base taken now goes
+  //under this one
+  if (sw->size > SWAP_COMPACT_BYTES + sw->basesize)
+    editorSwapCompact();
+
+  unsigned char head[32];
+  int hl = 0;
+  head[hl++] = type;
+  hl += editorSwapPutVarint(head + hl, y);
+  hl += editorSwapPutVarint(head + hl, x);
+  hl += editorSwapPutVarint(head + hl, len);
+
+  pthread_mutex_lock(&sw->lock);
+  if (sw->len + hl + len > sw->cap) {
+    sw->cap = (sw->len + hl + len) * 2;
+    sw->pending = realloc(sw->pending, sw->cap);
+  }
+  memcpy(sw->pending + sw->len, head, hl);
+  if (len) memcpy(sw->pending + sw->len + hl, text, len);
+  sw->len += hl + len;
+  pthread_cond_signal(&sw->wake);
+  pthread_mutex_unlock(&sw->lock);
+
+  sw->size += hl + len;
+}
+
+//stop the writer, keeping the journal only when asked
+void editorSwapStop(int keep) {
+  struct editorSwap *sw = &E.swap;
+  if (!keep) editorSwapRemove();
+  if (!sw->started) return;
+  editorSwapWait();
+  pthread_mutex_lock(&sw->lock);
+  sw->stop = 1;
+  pthread_cond_signal(&sw->wake);
+  pthread_mutex_unlock(&sw->lock);
+  pthread_join(sw->thread, NULL);
+  sw->started = 0;
+  sw->enabled = 0;
+}
+
+
+/*** regex ***/
+//regex search: the pattern is parsed into a tree, compiled into NFAs and
+//matched through DFAs whose states are only built when first reached, so
+//every byte costs one table lookup and no pattern can make matching
+//backtrack. Supported: literals, ., [] classes, \d \w \s and their
+//negations, * + ? | and (), with ^ and $ anchoring the whole pattern
+
+enum { RN_SET, RN_CAT, RN_ALT, RN_STAR, RN_PLUS, RN_QUEST, RN_EMPTY };
+
+//a parse tree node, children are indexes into the parser's pool; ch is
+//the byte of a single literal, else -1
+typedef struct renode {
+  int type;
+  int set;
+  int ch;
+  int a;
+  int b;
+} renode;
+
+typedef struct reparser {
+  const char *p;
+  const char *end;
+  int icase;
+  searchregex *re;
+  renode *nodes;
+  int nnodes;
+  int cap;
+  const char *error;
+} reparser;
+
+#define RE_HAS(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+#define RE_ADD(set, c) ((set)[(c) >> 3] |= 1 << ((c) & 7))
+
+int editorRegexNode(reparser *ps, int type, int set, int a, int b) {
+  if (ps->nnodes == ps->cap) {
+    ps->cap = ps->cap ? ps->cap * 2 : 32;
+    ps->nodes = realloc(ps->nodes, sizeof(renode) * ps->cap);
+  }
+  renode *n = &ps->nodes[ps->nnodes];
+  n->type = type;
+  n->set = set;
+  n->ch = -1;
+  n->a = a;
+  n->b = b;
+  return ps->nnodes++;
+}
+
+//store a byte set, closed under case when ignoring it (before negating,
+//so [^a] stays free of A)
+int editorRegexSet(reparser *ps, unsigned char *set, int negate) {
+  searchregex *re = ps->re;
+  if (ps->icase)
+    for (int c = 'a'; c <= 'z'; c++)
+      if (RE_HAS(set, c) || RE_HAS(set, toupper(c))) {
+        RE_ADD(set, c);
+        RE_ADD(set, toupper(c));
+      }
+  if (negate)
+    for (int i = 0; i < 32; i++) set[i] = ~set[i];
+  re->sets = realloc(re->sets, sizeof(*re->sets) * (re->nsets + 1));
+  memcpy(re->sets[re->nsets], set, 32);
+  return re->nsets++;
+}
+
+//\d \w \s into set, or 0 for any other escape
+int editorRegexClassEscape(int c, unsigned char *set) {
+  int lc = tolower(c);
+  if (lc != 'd' && lc != 'w' && lc != 's') return 0;
+  for (int b = 0; b < 256; b++)
+    if ((lc == 'd' && isdigit(b)) || (lc == 'w' && (isalnum(b) || b == '_')) ||
+        (lc == 's' && isspace(b)))
+      RE_ADD(set, b);
+  return 1;
+}
+
+int editorRegexAlt(reparser *ps);
+
+int editorRegexBracket(reparser *ps) {
+  unsigned char set[32] = {0};
+  int negate = 0;
+  if (ps->p < ps->end && *ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (ps->p < ps->end && (*ps->p != ']' || first)) {
+    first = 0;
+    unsigned char lo = *ps->p++;
+    if (lo == '\\' && ps->p < ps->end) {
+      lo = *ps->p++;
+      unsigned char cls[32] = {0};
+      if (editorRegexClassEscape(lo, cls)) {
+        for (int i = 0; i < 32; i++)
+          set[i] |= isupper(lo) ? ~cls[i] : cls[i];
+        continue;
+      }
+    }
+    unsigned char hi = lo;
+    if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+      hi = ps->p[1];
+      ps->p += 2;
+    }
+    for (int c = lo; c <= hi; c++) RE_ADD(set, c);
+  }
+  if (ps->p == ps->end) {
+    ps->error = "regex: missing ]";
+    return -1;
+  }
+  ps->p++;
+  return editorRegexNode(ps, RN_SET, editorRegexSet(ps, set, negate), -1, -1);
+}
+
+int editorRegexAtom(reparser *ps) {
+  unsigned char set[32] = {0};
+  unsigned char c = *ps->p++;
+  if (c == '(') {
+    int n = editorRegexAlt(ps);
+    if (n == -1) return -1;
+    if (ps->p == ps->end || *ps->p != ')') {
+      ps->error = "regex: missing )";
+      return -1;
+    }
+    ps->p++;
+    return n;
+  }
+  if (c == '[') return editorRegexBracket(ps);
+  if (c == '*' || c == '+' || c == '?') {
+    ps->error = "regex: nothing to repeat";
+    return -1;
+  }
+  if (c == '.') {
+    memset(set, 0xff, sizeof(set));
+    return editorRegexNode(ps, RN_SET, editorRegexSet(ps, set, 0), -1, -1);
+  }
+  if (c == '\\') {
+    if (ps->p == ps->end) {
+      ps->error = "regex: trailing \\";
+      return -1;
+    }
+    c = *ps->p++;
+    if (editorRegexClassEscape(c, set))
+      return editorRegexNode(ps, RN_SET, editorRegexSet(ps, set, isupper(c)),
+                             -1, -1);
+  }
+  RE_ADD(set, c);
+  int n = editorRegexNode(ps, RN_SET, editorRegexSet(ps, set, 0), -1, -1);
+  ps->nodes[n].ch = c;
+  return n;
+}
+
+int editorRegexRepeat(reparser *ps) {
+  int n = editorRegexAtom(ps);
+  while (n != -1 && ps->p < ps->end &&
+         (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+    char q = *ps->p++;
+    n = editorRegexNode(ps, q == '*' ? RN_STAR : q == '+' ? RN_PLUS : RN_QUEST,
+                        -1, n, -1);
+  }
+  return n;
+}
+
+int editorRegexCat(reparser *ps) {
+  int n = -1;
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+    int m = editorRegexRepeat(ps);
+    if (m == -1) return -1;
+    n = n == -1 ? m : editorRegexNode(ps, RN_CAT, -1, n, m);
+  }
+  return n == -1 ? editorRegexNode(ps, RN_EMPTY, -1, -1, -1) : n;
+}
+
+int editorRegexAlt(reparser *ps) {
+  int n = editorRegexCat(ps);
+  while (n != -1 && ps->p < ps->end && *ps->p == '|') {
+    ps->p++;
+    int m = editorRegexCat(ps);
+    if (m == -1) return -1;
+    n = editorRegexNode(ps, RN_ALT, -1, n, m);
+  }
+  return n;
+}
+
+int editorRegexEmit(reprog *prog, int op, int set, int x, int y) {
+  if (prog->n == prog->cap) {
+    prog->cap = prog->cap ? prog->cap * 2 : 32;
+    prog->inst = realloc(prog->inst, sizeof(reinst) * prog->cap);
+  }
+  reinst *in = &prog->inst[prog->n];
+  in->op = op;
+  in->set = set;
+  in->x = x;
+  in->y = y;
+  return prog->n++;
+}
+
+//Thompson construction of node n; rev lays concatenations out backwards
+//for the program that reads text from the end
+void editorRegexCompileNode(reprog *prog, const renode *nodes, int n, int rev) {
+  const renode *node = &nodes[n];
+  int at;
+  switch (node->type) {
+    case RN_SET:
+      editorRegexEmit(prog, RI_SET, node->set, prog->n + 1, -1);
+      break;
+    case RN_CAT:
+      editorRegexCompileNode(prog, nodes, rev ? node->b : node->a, rev);
+      editorRegexCompileNode(prog, nodes, rev ? node->a : node->b, rev);
+      break;
+    case RN_ALT: {
+      at = editorRegexEmit(prog, RI_SPLIT, -1, prog->n + 1, -1);
+      editorRegexCompileNode(prog, nodes, node->a, rev);
+      int jmp = editorRegexEmit(prog, RI_JMP, -1, -1, -1);
+      prog->inst[at].y = prog->n;
+      editorRegexCompileNode(prog, nodes, node->b, rev);
+      prog->inst[jmp].x = prog->n;
+      break;
+    }
+    case RN_STAR:
+      at = editorRegexEmit(prog, RI_SPLIT, -1, prog->n + 1, -1);
+      editorRegexCompileNode(prog, nodes, node->a, rev);
+      editorRegexEmit(prog, RI_JMP, -1, at, -1);
+      prog->inst[at].y = prog->n;
+      break;
+    case RN_PLUS:
+      at = prog->n;
+      editorRegexCompileNode(prog, nodes, node->a, rev);
+      editorRegexEmit(prog, RI_SPLIT, -1, at, prog->n + 1);
+      break;
+    case RN_QUEST:
+      at = editorRegexEmit(prog, RI_SPLIT, -1, prog->n + 1, -1);
+      editorRegexCompileNode(prog, nodes, node->a, rev);
+      prog->inst[at].y = prog->n;
+      break;
+  }
+}
+
+//end the literal run being collected, keeping it if it is not empty
+void editorRegexEndRun(searchregex *re, char *run, int *len) {
+  if (*len == 0) return;
+  re->lits = realloc(re->lits, sizeof(char *) * (re->nlits + 1));
+  re->lits[re->nlits] = malloc(*len + 1);
+  memcpy(re->lits[re->nlits], run, *len);
+  re->lits[re->nlits++][*len] = '\0';
+  *len = 0;
+}
+
+//runs of single literals that every match passes through in order,
+//looking through concatenations only
+void editorRegexLiterals(searchregex *re, const renode *nodes, int n,
+                         char *run, int *len) {
+  const renode *node = &nodes[n];
+  if (node->type == RN_CAT) {
+    editorRegexLiterals(re, nodes, node->a, run, len);
+    editorRegexLiterals(re, nodes, node->b, run, len);
+  } else if (node->type == RN_SET && node->ch != -1) {
+    run[(*len)++] = node->ch;
+  } else if (node->type != RN_EMPTY) {
+    editorRegexEndRun(re, run, len);
+  }
+}
+
+int editorRegexCmpLen(const void *a, const void *b) {
+  return strlen(*(char *const *)b) - strlen(*(char *const *)a);
+}
+
+//group bytes into classes by refining on every set in turn, so DFA
+//states only need an edge per class
+void editorRegexClasses(searchregex *re) {
+  memset(re->classof, 0, sizeof(re->classof));
+  re->nclasses = 1;
+  for (int s = 0; s < re->nsets; s++) {
+    int map[2][256];
+    unsigned char next[256];
+    int n = 0;
+    memset(map, -1, sizeof(map));
+    for (int c = 0; c < 256; c++) {
+      int in = RE_HAS(re->sets[s], c) ? 1 : 0;
+      if (map[in][re->classof[c]] == -1) map[in][re->classof[c]] = n++;
+      next[c] = map[in][re->classof[c]];
+    }
+    memcpy(re->classof, next, sizeof(next));
+    re->nclasses = n;
+  }
+  for (int c = 255; c >= 0; c--) re->classrep[re->classof[c]] = c;
+}
+
+int editorRegexCmpInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+//add pc and everything reachable from it without consuming a byte to
+//the list of the state being built
+void editorRegexFollow(redfa *d, int pc, int *n) {
+  int sp = 0;
+  if (d->seen[pc] == d->stamp) return;
+  d->seen[pc] = d->stamp;
+  d->stack[sp++] = pc;
+  while (sp) {
+    pc = d->stack[--sp];
+    const reinst *in = &d->prog->inst[pc];
+    if (in->op == RI_SET || in->op == RI_MATCH) {
+      d->list[(*n)++] = pc;
+      continue;
+    }
+    if (in->op == RI_SPLIT && d->seen[in->y] != d->stamp) {
+      d->seen[in->y] = d->stamp;
+      d->stack[sp++] = in->y;
+    }
+    if (d->seen[in->x] != d->stamp) {
+      d->seen[in->x] = d->stamp;
+      d->stack[sp++] = in->x;
+    }
+  }
+}
+
+void editorRegexBegin(redfa *d) {
+  if (++d->stamp == 0) {
+    memset(d->seen, 0, sizeof(unsigned int) * d->prog->n);
+    d->stamp = 1;
+  }
+}
+
+//the state for the n instructions on the list, added if new; -1 when the
+//cache is full
+int editorRegexState(redfa *d, int n) {
+  qsort(d->list, n, sizeof(int), editorRegexCmpInt);
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) h = (h ^ d->list[i]) * 16777619u;
+  int mask = REGEX_MAX_STATES * 2 - 1;
+  int slot = h & mask;
+  for (; d->table[slot] != -1; slot = (slot + 1) & mask) {
+    redstate *s = &d->states[d->table[slot]];
+    if (s->n == n && !memcmp(s->insts, d->list, sizeof(int) * n))
+      return d->table[slot];
+  }
+  if (d->nstates == REGEX_MAX_STATES) return -1;
+  redstate *s = &d->states[d->nstates];
+  s->insts = malloc(sizeof(int) * (n + 1));
+  memcpy(s->insts, d->list, sizeof(int) * n);
+  s->n = n;
+  int *edges = &d->trans[d->nstates * d->stride];
+  for (int k = 0; k < d->nclasses; k++) edges[k] = -1;
+  edges[d->nclasses] = 0;
+  for (int i = 0; i < n; i++)
+    if (d->prog->inst[d->list[i]].op == RI_MATCH) edges[d->nclasses] = 1;
+  d->table[slot] = d->nstates;
+  return d->nstates++;
+}
+
+//drop every state but the dead and start ones
+void editorRegexReset(redfa *d) {
+  for (int i = 0; i < d->nstates; i++) free(d->states[i].insts);
+  d->nstates = 0;
+  d->resets++;
+  for (int i = 0; i < REGEX_MAX_STATES * 2; i++) d->table[i] = -1;
+  editorRegexState(d, 0);
+  int n = 0;
+  editorRegexBegin(d);
+  editorRegexFollow(d, 0, &n);
+  editorRegexState(d, n);
+}
+
+void editorRegexDfaInit(redfa *d, const searchregex *re, const reprog *prog,
+                        int unanchored) {
+  d->prog = prog;
+  d->sets = (const unsigned char (*)[32])re->sets;
+  d->rep = re->classrep;
+  d->nclasses = re->nclasses;
+  d->unanchored = unanchored;
+  d->states = malloc(sizeof(redstate) * REGEX_MAX_STATES);
+  d->nstates = 0;
+  d->stride = d->nclasses + 1;
+  d->trans = malloc(sizeof(int) * REGEX_MAX_STATES * d->stride);
+  d->table = malloc(sizeof(int) * REGEX_MAX_STATES * 2);
+  d->seen = calloc(prog->n, sizeof(unsigned int));
+  d->stamp = 0;
+  d->resets = 0;
+  d->list = malloc(sizeof(int) * prog->n);
+  d->stack = malloc(sizeof(int) * prog->n);
+  d->saved = malloc(sizeof(int) * prog->n);
+  editorRegexReset(d);
+}
+
+void editorRegexDfaFree(redfa *d) {
+  for (int i = 0; i < d->nstates; i++) free(d->states[i].insts);
+  free(d->states);
+  free(d->trans);
+  free(d->table);
+  free(d->seen);
+  free(d->list);
+  free(d->stack);
+  free(d->saved);
+}
+
+//the row offset of the state reached from the state at row offset off on
+//a byte of class cls, built the first time the edge is taken. A full
+//cache starts over, which keeps memory bounded on patterns whose DFA
+//would be exponential
+int editorRegexStep(redfa *d, int off, int cls) {
+  int *edge = &d->trans[off + cls];
+  if (*edge != -1) return *edge;
+  const redstate *s = &d->states[off / d->stride];
+  int c = d->rep[cls];
+  int n = 0;
+  editorRegexBegin(d);
+  for (int i = 0; i < s->n; i++) {
+    const reinst *in = &d->prog->inst[s->insts[i]];
+    if (in->op == RI_SET && RE_HAS(d->sets[in->set], c))
+      editorRegexFollow(d, in->x, &n);
+  }
+  if (d->unanchored) editorRegexFollow(d, 0, &n);
+  int to = editorRegexState(d, n);
+  if (to != -1) {
+    *edge = to * d->stride;
+    return *edge;
+  }
+  memcpy(d->saved, d->list, sizeof(int) * n);
+  editorRegexReset(d);
+  memcpy(d->list, d->saved, sizeof(int) * n);
+  return editorRegexState(d, n) * d->stride;
+}
+
+void editorRegexFree(searchregex *re) {
+  if (re == NULL) return;
+  editorRegexDfaFree(&re->fdfa);
+  editorRegexDfaFree(&re->rdfa);
+  free(re->starts);
+  free(re->runstates);
+  if (re->owner) {
+    free(re->fwd.inst);
+    free(re->rev.inst);
+    free(re->sets);
+    for (int i = 0; i < re->nlits; i++) free(re->lits[i]);
+    free(re->lits);
+    free(re->litpats);
+  }
+  free(re);
+}
+
+//build the DFAs of a compiled or copied regex
+void editorRegexStart(searchregex *re) {
+  editorRegexDfaInit(&re->fdfa, re, &re->fwd, 0);
+  editorRegexDfaInit(&re->rdfa, re, &re->rev, !re->eol);
+  re->starts = NULL;
+  re->startcap = 0;
+  re->runstates = NULL;
+}
+
+//a copy for another thread: shares the programs, builds its own DFAs
+searchregex *editorRegexClone(const searchregex *re) {
+  searchregex *c = malloc(sizeof(searchregex));
+  *c = *re;
+  c->owner = 0;
+  editorRegexStart(c);
+  return c;
+}
+
+//compile pattern, or return NULL with the reason in *error
+searchregex *editorRegexCompile(const char *pattern, int icase,
+                                const char **error) {
+  searchregex *re = calloc(1, sizeof(searchregex));
+  re->owner = 1;
+  reparser ps = {pattern, pattern + strlen(pattern), icase, re, NULL, 0, 0, NULL};
+  if (ps.p < ps.end && *ps.p == '^') {
+    re->bol = 1;
+    ps.p++;
+  }
+  //a $ ends the pattern unless it is escaped
+  if (ps.end > ps.p && ps.end[-1] == '$') {
+    const char *q = ps.end - 1;
+    while (q > ps.p && q[-1] == '\\') q--;
+    if ((ps.end - 1 - q) % 2 == 0) {
+      re->eol = 1;
+      ps.end--;
+    }
+  }
+  int root = editorRegexAlt(&ps);
+  if (root != -1 && ps.p < ps.end) {
+    ps.error = "regex: unmatched )";
+    root = -1;
+  }
+  if (root == -1) {
+    *error = ps.error;
+    free(ps.nodes);
+    free(re->sets);
+    free(re);
+    return NULL;
+  }
+
+  editorRegexCompileNode(&re->fwd, ps.nodes, root, 0);
+  editorRegexEmit(&re->fwd, RI_MATCH, -1, -1, -1);
+  editorRegexCompileNode(&re->rev, ps.nodes, root, 1);
+  editorRegexEmit(&re->rev, RI_MATCH, -1, -1, -1);
+  editorRegexClasses(re);
+
+  char *run = malloc(ps.end - pattern + 1);
+  int len = 0;
+  editorRegexLiterals(re, ps.nodes, root, run, &len);
+  editorRegexEndRun(re, run, &len);
+  free(run);
+  qsort(re->lits, re->nlits, sizeof(char *), editorRegexCmpLen);
+  re->litpats = malloc(sizeof(searchpat) * (re->nlits + 1));
+  for (int i = 0; i < re->nlits; i++)
+    re->litpats[i] = editorSearchCompile(re->lits[i], icase, 0);
+  free(ps.nodes);
+  editorRegexStart(re);
+  return re;
+}
+
+//the leftmost match in text[from, len), longest at that start, that is
+//not empty: returns its start and its end in *end, or -1. When from is
+//0 one backward pass marks every byte a match starts at; later calls walk
+//on through the same text using those marks. A pattern matching the
+//empty string marks every byte, and each forward run can go on far past
+//its match: a run that reaches a byte in the state the last run had
+//there goes on the same way, so it stops and takes that run's end
+int editorRegexSearch(searchregex *re, const char *text, int len, int from,
+                      int *end) {
+  if (from == 0) {
+    for (int i = 0; i < re->nlits; i++)
+      if (editorSearchText(&re->litpats[i], text, len, 0) == -1) return -1;
+    re->runend = 0;
+    if (len > re->startcap) {
+      re->startcap = len * 2;
+      re->starts = realloc(re->starts, re->startcap);
+      re->runstates = realloc(re->runstates,
+        sizeof(int) * (re->startcap / REGEX_RUN_STRIDE + 1));
+    }
+    if (!re->bol) {
+      //locals, so the byte stores cannot make the compiler reload them
+      redfa *d = &re->rdfa;
+      const int *trans = d->trans;
+      const unsigned char *classof = re->classof;
+      unsigned char *starts = re->starts;
+      int accept = d->nclasses;
+      int s = d->stride;
+      int i = len - 1;
+      for (; i >= 0; i--) {
+        int cls = classof[(unsigned char)text[i]];
+        int to = trans[s + cls];
+        s = to != -1 ? to : editorRegexStep(d, s, cls);
+        if (s == 0) break;
+        starts[i] = trans[s + accept];
+      }
+      if (i >= 0) memset(starts, 0, i + 1);
+    }
+  }
+  for (int i = from; i < len; i++) {
+    if (re->bol ? i != 0 : !re->starts[i]) {
+      if (re->bol) return -1;
+      continue;
+    }
+    redfa *d = &re->fdfa;
+    int s = d->stride;
+    int best = -1;
+    int resets = d->resets;
+    int last = re->runresets == resets ? re->runend : 0;
+    int j;
+    for (j = i; j < len; j++) {
+      int cls = re->classof[(unsigned char)text[j]];
+      int to = d->trans[s + cls];
+      s = to != -1 ? to : editorRegexStep(d, s, cls);
+      if (s == 0) break;
+      if (d->trans[s + d->nclasses] && (!re->eol || j + 1 == len))
+        best = j + 1;
+      if (j % REGEX_RUN_STRIDE || d->resets != resets) continue;
+      int *at = &re->runstates[j / REGEX_RUN_STRIDE];
+      if (j < last && *at == s) {
+        if (re->runbest > j + 1) best = re->runbest;
+        j = last;
+        break;
+      }
+      *at = s;
+    }
+    //a cache that started over renumbered the states noted
+    re->runend = d->resets == resets ? j : 0;
+    re->runbest = best;
+    re->runresets = resets;
+    if (best != -1) {
+      *end = best;
+      return i;
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-
-  editorUpdateSyntax(row);
+  return -1;
 }
 
-
-
-//allocate space for row and copy string over 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) 
-    return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  editorUpdateRow(&E.row[at]);
-
-  E.numrows++; 
-  E.dirty++;
+/*** search ***/
+searchpat editorSearchCompile(const char *query, int icase, int regex) {
+  editorSearchFoldInit();
+  searchpat pat;
+  pat.s = query;
+  pat.len = strlen(query);
+  pat.icase = icase;
+  pat.re = NULL;
+  pat.error = NULL;
+  if (regex) {
+    pat.re = editorRegexCompile(query, icase, &pat.error);
+    //a pattern that does not compile matches nothing
+    if (pat.re == NULL) pat.len = 0;
+  }
+  pat.first = pat.len ? (unsigned char)query[0] : 0;
+  pat.last = pat.len ? (unsigned char)query[pat.len - 1] : 0;
+  if (icase) {
+    pat.first = searchfold[pat.first];
+    pat.last = searchfold[pat.last];
+  }
+  return pat;
 }
 
-//free memory owned by specific erow
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+int editorSearchMatchAt(const searchpat *pat, const char *t) {
+  if (!pat->icase)
+    return !memcmp(t, pat->s, pat->len);
+  for (int j = 0; j < pat->len; j++)
+    if (searchfold[(unsigned char)t[j]] != searchfold[(unsigned char)pat->s[j]])
+      return 0;
+  return 1;
 }
 
-
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) 
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+//offset of the first occurrence of pat in text[from, len), or -1; sixteen
+//positions at a time are filtered on the query's first and last byte and
+//only positions where both agree are compared in full
+int editorSearchText(const searchpat *pat, const char *text, int len, int from) {
+  int m = pat->len;
+  int i = from;
+  if (m == 0 || m > len) return -1;
+#ifdef __SSE2__
+  __m128i f = _mm_set1_epi8(pat->first);
+  __m128i l = _mm_set1_epi8(pat->last);
+  __m128i fu = _mm_set1_epi8(pat->icase ? toupper(pat->first) : pat->first);
+  __m128i lu = _mm_set1_epi8(pat->icase ? toupper(pat->last) : pat->last);
+  for (; i + m - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(text + i + m - 1));
+    __m128i ea = _mm_or_si128(_mm_cmpeq_epi8(a, f), _mm_cmpeq_epi8(a, fu));
+    __m128i eb = _mm_or_si128(_mm_cmpeq_epi8(b, l), _mm_cmpeq_epi8(b, lu));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(ea, eb));
+    while (mask) {
+      int at = i + __builtin_ctz(mask);
+      if (editorSearchMatchAt(pat, text + at)) return at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  if (!pat->icase) {
+    while (i + m <= len) {
+      const char *hit = memchr(text + i, pat->first, len - m + 1 - i);
+      if (hit == NULL) return -1;
+      i = hit - text;
+      if ((unsigned char)text[i + m - 1] == pat->last &&
+          editorSearchMatchAt(pat, text + i))
+        return i;
+      i++;
+    }
+    return -1;
+  }
+  for (; i + m <= len; i++)
+    if (searchfold[(unsigned char)text[i]] == pat->first &&
+        searchfold[(unsigned char)text[i + m - 1]] == pat->last &&
+        editorSearchMatchAt(pat, text + i))
+      return i;
+  return -1;
 }
 
-//inserts character into erow with given position
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) 
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+//the first match of pat in text[from, len): its offset, with its end in
+//*end, or -1. A regex's text is walked from 0 on (see editorRegexSearch)
+int editorSearchNext(const searchpat *pat, const char *text, int len, int from,
+                     int *end) {
+  if (pat->re) return editorRegexSearch(pat->re, text, len, from, end);
+  int i = editorSearchText(pat, text, len, from);
+  *end = i + pat->len;
+  return i;
 }
 
-//appending a string to a row
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+//matches of pat in text, not overlapping; the first max byte offsets are
+//stored in at
+int editorSearchAll(const searchpat *pat, const char *text, int len,
+                    int *at, int max) {
+  int n = 0;
+  int end;
+  int i = editorSearchNext(pat, text, len, 0, &end);
+  while (i != -1) {
+    if (n < max) at[n] = i;
+    n++;
+    i = editorSearchNext(pat, text, len, end, &end);
+  }
+  return n;
 }
 
-//delete character in erow (overwrite deleted char with char after it)
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void editorSearchFree(searchpat *pat) {
+  editorRegexFree(pat->re);
+  pat->re = NULL;
 }
 
-//del leftside character of cursor
-void editorDelChar() {
-  //cursor past EOF
-  if (E.cursor_y == E.numrows) return;
-  if (E.cursor_x == 0 && E.cursor_y == 0) return;
-  erow *row = &E.row[E.cursor_y];
-
-  if (E.cursor_x > 0) {
-    editorRowDelChar(row, E.cursor_x - 1);
-    E.cursor_x--;
-  } 
-  //deleting a line so move all current contents to above line
-  else {
-    E.cursor_x = E.row[E.cursor_y - 1].size;
-    editorRowAppendString(&E.row[E.cursor_y - 1], row->chars, row->size);
-    editorDelRow(E.cursor_y);
-    E.cursor_y--;
-  }
+//the compiled form of query in the current modes, kept while neither
+//changes so a regex is compiled once and its DFA states are reused
+searchpat *editorSearchPattern(const char *query) {
+  struct editorSearchState *s = &E.search;
+  int modes = s->icase | s->regex << 1;
+  if (s->patquery && s->patmodes == modes && !strcmp(s->patquery, query))
+    return &s->pat;
+  editorSearchFree(&s->pat);
+  free(s->patquery);
+  s->patquery = strdup(query);
+  s->patmodes = modes;
+  s->pat = editorSearchCompile(s->patquery, s->icase, s->regex);
+  return &s->pat;
 }
 
-/*** editor operations ***/
-//appends a new row before character insertion
-void editorInsertChar(int c) {
-  if (E.cursor_y == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+//a slice of the rows (or of a previous level's rows) searched on one thread
+typedef struct searchtask {
+  const searchpat *pat;
+  searchpat own;
+  const searchlevel *prev;
+  int lo;
+  int hi;
+  int *rows;
+  int *counts;
+  int n;
+} searchtask;
+
+//rows are only read here, the input thread waits for every task so the
+//tree cannot change underneath; row text goes through a scratch buffer
+//of the task's own
+void *editorSearchTask(void *arg) {
+  searchtask *t = arg;
+  char *scratch = NULL;
+  int cap = 0;
+  rowiter it;
+  erow *row = NULL;
+  int at = -1;
+  t->rows = malloc(sizeof(int) * (t->hi - t->lo + 1));
+  t->counts = malloc(sizeof(int) * (t->hi - t->lo + 1));
+  t->n = 0;
+  for (int k = t->lo; k < t->hi; k++) {
+    int want = t->prev ? t->prev->rows[k] : k;
+    //walk the leaf chain to nearby rows, descend for far ones
+    if (row == NULL || want - at > ROW_LEAF_MAX) {
+      row = editorRowIterStart(&it, want);
+      at = want;
+    }
+    for (; at < want; at++)
+      row = editorRowIterNext(&it);
+    const char *text = editorRowText(row, &scratch, &cap);
+    int c = editorSearchAll(t->pat, text, row->size, NULL, 0);
+    if (c) {
+      t->rows[t->n] = want;
+      t->counts[t->n++] = c;
+    }
   }
-  editorRowInsertChar(&E.row[E.cursor_y], E.cursor_x, c);
-  E.cursor_x++;
+  free(scratch);
+  return NULL;
 }
 
-void editorInsertNewline() {
-  //if beginning of line, insert new blank row above line
-  if (E.cursor_x == 0) {
-    editorInsertRow(E.cursor_y, "", 0);
-  } 
-  //split line into 2 rows
-  else {
-    erow *row = &E.row[E.cursor_y];
-    editorInsertRow(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
-    row = &E.row[E.cursor_y];
-    row->size = E.cursor_x;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+//search the rows of prev (all rows without one) into lv, in slices on as
+//many threads as the work calls for, joined back in row order
+void editorSearchScan(const searchpat *pat, const searchlevel *prev,
+                      searchlevel *lv) {
+  int items = prev ? prev->n : E.numrows;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > items / SEARCH_ROWS_PER_THREAD)
+    nthreads = items / SEARCH_ROWS_PER_THREAD;
+  if (nthreads > SEARCH_MAX_THREADS) nthreads = SEARCH_MAX_THREADS;
+  if (nthreads < 1) nthreads = 1;
+
+  searchtask tasks[SEARCH_MAX_THREADS];
+  pthread_t tids[SEARCH_MAX_THREADS];
+  int started[SEARCH_MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    //a regex's DFAs are built while matching, so threads get their own
+    tasks[t].pat = pat;
+    if (t > 0 && pat->re) {
+      tasks[t].own = *pat;
+      tasks[t].own.re = editorRegexClone(pat->re);
+      tasks[t].pat = &tasks[t].own;
+    }
+    tasks[t].prev = prev;
+    tasks[t].lo = (long long)items * t / nthreads;
+    tasks[t].hi = (long long)items * (t + 1) / nthreads;
+    started[t] = t > 0 &&
+      pthread_create(&tids[t], NULL, editorSearchTask, &tasks[t]) == 0;
+  }
+  //the first slice, and any a thread could not be started for, run here
+  for (int t = 0; t < nthreads; t++)
+    if (!started[t]) editorSearchTask(&tasks[t]);
+
+  int n = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (started[t]) pthread_join(tids[t], NULL);
+    n += tasks[t].n;
+  }
+  lv->rows = malloc(sizeof(int) * (n ? n : 1));
+  lv->first = malloc(sizeof(int) * (n ? n : 1));
+  lv->n = 0;
+  lv->total = 0;
+  for (int t = 0; t < nthreads; t++) {
+    for (int k = 0; k < tasks[t].n; k++) {
+      lv->rows[lv->n] = tasks[t].rows[k];
+      lv->first[lv->n++] = lv->total;
+      lv->total += tasks[t].counts[k];
+    }
+    free(tasks[t].rows);
+    free(tasks[t].counts);
+    if (tasks[t].pat != pat) editorSearchFree(&tasks[t].own);
   }
-  E.cursor_y++;
-  E.cursor_x = 0;
 }
 
+void editorSearchSetPrompt() {
+  snprintf(E.search.prompt, sizeof(E.search.prompt),
+    "Search: %%s (ESC/Arrows/Enter, Ctrl-T %s, Ctrl-R %s)",
+    E.search.icase ? "match case" : "ignore case",
+    E.search.regex ? "literal" : "regex");
+}
 
-/*** file i/o  ***/
-//convert contents into buffer for saving 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+//forget candidate sets deeper than n
+void editorSearchDropLevels(int n) {
+  while (E.search.nlevels > n) {
+    searchlevel *lv = &E.search.levels[--E.search.nlevels];
+    free(lv->query);
+    free(lv->rows);
+    free(lv->first);
+    E.search.active = 0;
   }
-  return buf;
 }
 
+//matches of query, found by narrowing the set of the longest earlier query
+//that is a prefix of this one, or a full scan without one. A longer regex
+//can match rows its prefix did not (a|b), so regexes always scan in full,
+//through the rows holding their required literal when there is an index
+searchlevel *editorSearchRows(const char *query) {
+  int len = strlen(query);
+  while (E.search.nlevels > 0) {
+    searchlevel *top = &E.search.levels[E.search.nlevels - 1];
+    int tlen = strlen(top->query);
+    if (tlen <= len && !strncmp(top->query, query, tlen)) {
+      if (tlen == len) return top;
+      if (!E.search.regex) break;
+    }
+    editorSearchDropLevels(E.search.nlevels - 1);
+  }
 
-//read from file if possible and output each line to editor
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-  editorSelectSyntaxHighlight();
+  searchpat *pat = editorSearchPattern(query);
+  searchlevel lv;
+  searchlevel cand;
+  char *const *lits = (char *const *)&query;
+  int nlits = 1;
+  if (E.search.regex) {
+    lits = pat->re ? pat->re->lits : NULL;
+    nlits = pat->re ? pat->re->nlits : 0;
+  }
+  lv.query = strdup(query);
+  if (E.search.nlevels)
+    editorSearchScan(pat, &E.search.levels[E.search.nlevels - 1], &lv);
+  else if (editorTrigramCandidates(lits, nlits, &cand)) {
+    editorSearchScan(pat, &cand, &lv);
+    free(cand.rows);
+  } else
+    editorSearchScan(pat, NULL, &lv);
+
+  E.search.levels = realloc(E.search.levels,
+    sizeof(searchlevel) * (E.search.nlevels + 1));
+  E.search.levels[E.search.nlevels] = lv;
+  return &E.search.levels[E.search.nlevels++];
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+//the level of the query being shown while the prompt is up, else NULL
+searchlevel *editorSearchShown() {
+  if (!E.search.active || E.search.nlevels == 0) return NULL;
+  return &E.search.levels[E.search.nlevels - 1];
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+//index into lv->rows of row at, or -1
+int editorSearchFindRow(const searchlevel *lv, int at) {
+  int lo = 0, hi = lv->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lv->rows[mid] < at) lo = mid + 1;
+    else hi = mid;
   }
-  free(line); 
-  fclose(fp); 
-  //reset dirty flag
-  E.dirty = 0;
+  return (lo < lv->n && lv->rows[lo] == at) ? lo : -1;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+//render columns [start, end) of the shown query's matches in row at that
+//reach the visible columns, as pairs in *spans; returns how many
+int editorSearchSpans(int at, erow *row, int **spans, int *cap) {
+  searchlevel *lv = editorSearchShown();
+  if (lv == NULL || editorSearchFindRow(lv, at) == -1) return 0;
+  searchpat *pat = editorSearchPattern(lv->query);
+  const char *text;
+  int base = 0;
+  int len = row->size;
+  if (editorRowIsLong(row)) {
+    //only the bytes around the screen are searched, a match starting
+    //further left than its length (a stride for regexes) goes unmarked
+    static char *window = NULL;
+    static int windowcap = 0;
+    int reach = pat->re ? COLMAP_STRIDE : pat->len;
+    base = editorRowRxToCursor_x(row, E.coloffset) - reach;
+    if (base < 0) base = 0;
+    int to = editorRowRxToCursor_x(row, E.coloffset + E.screen_cols) + reach;
+    if (to > row->size) to = row->size;
+    len = to - base;
+    if (len > windowcap) {
+      windowcap = len;
+      window = realloc(window, windowcap);
     }
-    editorSelectSyntaxHighlight();
+    editorRowCopy(row, base, to, window);
+    text = window;
+  } else {
+    text = editorRowFlatten(row);
   }
-
-  int len;
-  char *buf = editorRowsToString(&len);
-  //create new file if not existing,open for read/writes
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        //set file to specified length
-        ftruncate(fd, len);
-        write(fd, buf, len);
-        close(fd);
-        free(buf);
-        //changes have been saved 
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-         return;
+  int n = 0;
+  int stop;
+  int i = editorSearchNext(pat, text, len, 0, &stop);
+  while (i != -1) {
+    int rx = editorRowCursor_xToRx(row, base + i);
+    if (rx >= E.coloffset + E.screen_cols) break;
+    int end = editorRowCursor_xToRx(row, base + stop);
+    if (end > E.coloffset) {
+      if (2 * (n + 1) > *cap) {
+        *cap = *cap ? *cap * 2 : 32;
+        *spans = realloc(*spans, sizeof(int) * *cap);
       }
+      (*spans)[2 * n] = rx;
+      (*spans)[2 * n + 1] = end;
+      n++;
     }
-    close(fd);
+    i = editorSearchNext(pat, text, len, stop, &stop);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return n;
 }
 
+//the nearest line after a large file's window (dir 1) or before it (-1)
+//holding a match of pat, streamed through the mapping a line at a time:
+//where it starts, with its line number in *line, -1 if there is none or
+//-2 when a key was typed before one was found
+long long editorLargeFind(const searchpat *pat, int dir, long long *line) {
+  struct editorLarge *lg = &E.large;
+  size_t off = dir > 0 ? lg->end : lg->start;
+  size_t done = off;
+  long long at = dir > 0 ? lg->line + E.numrows : lg->line;
+  long long found = -1;
+  while (found == -1 && (dir > 0 ? off < E.maplen : off > 0)) {
+    size_t start, end;
+    if (dir > 0) {
+      const char *nl = memchr(E.map + off, '\n', E.maplen - off);
+      start = off;
+      end = nl ? (size_t)(nl - E.map) : E.maplen;
+      off = nl ? end + 1 : E.maplen;
+    } else {
+      end = off - 1;
+      const char *nl = memrchr(E.map, '\n', end);
+      start = nl ? (size_t)(nl + 1 - E.map) : 0;
+      off = start;
+      at--;
+    }
+    //as the line's row would hold it
+    while (end > start && E.map[end - 1] == '\r')
+      end--;
+    int stop;
+    if (end - start <= INT_MAX &&
+        editorSearchNext(pat, E.map + start, end - start, 0, &stop) != -1) {
+      found = start;
+      *line = at;
+    }
+    if (dir > 0) at++;
+    //a megabyte at a time, stopping early for a key
+    if (dir > 0 ? off - done >= 1 << 20 : done - off >= 1 << 20) {
+      editorLargeRelease(dir > 0 ? done : off, dir > 0 ? off : done);
+      done = off;
+      if (found == -1 && editorInputPending()) return -2;
+    }
+  }
+  return found;
+}
 
-//search query feature
-//go through all rows and look for matching target
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
-
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+//step from the window's last match of query to the first after the
+//window, or from its first to the last before it, loading the window
+//there; the query's level in the window it ends up in
+searchlevel *editorLargeFindStep(const char *query, searchlevel *lv, int dir) {
+  long long line;
+  if (!editorLargeCanMove()) return lv;
+  long long off = editorLargeFind(editorSearchPattern(query), dir, &line);
+  if (off == -2) {
+    //interrupted: stay on the window's last match in that direction
+    E.search.current = dir > 0 ? lv->total - 1 : 0;
+    return lv;
   }
+  if (off == -1) return lv;
+  editorLargeCenter(off, line);
+  lv = editorSearchRows(query);
+  int k = editorSearchFindRow(lv, line - E.large.line);
+  if (k != -1)
+    E.search.current = dir > 0 ? lv->first[k]
+                     : (k + 1 < lv->n ? lv->first[k + 1] : lv->total) - 1;
+  return lv;
+}
 
-  //traverse through search query matches
+//search query feature
+//every match is found up front, the arrows step through the list; in a
+//large file stepping past the window's matches with an arrow searches on
+//through the rest of the file, typing the query only searches the window
+void editorFindCallback(char *query, int key) {
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+    editorSearchDropLevels(0);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) 
-    {direction = 1;} 
-    else if (key == ARROW_LEFT || key == ARROW_UP) 
-    {direction = -1;} 
-    else {
-    last_match = -1;
-    direction = 1;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    E.search.current++;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    E.search.current--;
+  } else {
+    if (key == CTRL_KEY('t') || key == CTRL_KEY('r')) {
+      if (key == CTRL_KEY('t')) E.search.icase = !E.search.icase;
+      else E.search.regex = !E.search.regex;
+      editorSearchSetPrompt();
+      editorSearchDropLevels(0);
+    }
+    E.search.current = 0;
   }
 
-  if (last_match == -1) 
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cursor_y = current;
-      E.cursor_x = editorRowRxToCursor_x(row, match - row->render); 
-      E.rowoffset = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+  if (query[0] == '\0') {
+    E.search.active = 0;
+    return;
+  }
+  searchlevel *lv = editorSearchRows(query);
+  //the direction comes from the key, current says nothing once a step
+  //found no match at all
+  int dir = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 :
+            (key == ARROW_LEFT || key == ARROW_UP) ? -1 : 0;
+  if (E.large.on && dir &&
+      (E.search.current < 0 || E.search.current >= lv->total))
+    lv = editorLargeFindStep(query, lv, dir);
+  E.search.active = 1;
+  if (lv->total == 0) {
+    E.search.current = 0;
+    return;
   }
+  if (E.search.current < 0) E.search.current = lv->total - 1;
+  if (E.search.current >= lv->total) E.search.current = 0;
+
+  //the row holding the current match: last one whose matches start at or
+  //before it
+  int lo = 0, hi = lv->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lv->first[mid] <= E.search.current) lo = mid + 1;
+    else hi = mid;
+  }
+  int k = lo - 1;
+  int nth = E.search.current - lv->first[k];
+
+  searchpat *pat = editorSearchPattern(query);
+  erow *row = editorRowAt(lv->rows[k]);
+  const char *text = editorRowFlatten(row);
+  int end;
+  int i = editorSearchNext(pat, text, row->size, 0, &end);
+  while (nth--)
+    i = editorSearchNext(pat, text, row->size, end, &end);
+  E.cursor_y = lv->rows[k];
+  E.cursor_x = i;
+  E.rowoffset = E.numrows;
 }
 
 void editorFind() {
@@ -703,41 +5373,47 @@ void editorFind() {
   int saved_cy = E.cursor_y;
   int saved_coloff = E.coloffset;
   int saved_rowoff = E.rowoffset;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
+  long long saved_first = editorFirstLine();
+  editorSearchDropLevels(0);
+  editorSearchSetPrompt();
+  char *query = editorPrompt(E.search.prompt, editorFindCallback);
 
   if (query) {
     free(query);
   } 
   //restore cursor position when cancelled search 
   else {
+    //a large file's window may have moved since
+    if (E.large.on) {
+      editorLargeGoto(saved_first + saved_cy);
+      saved_rowoff += saved_first - editorFirstLine();
+      saved_cy = E.cursor_y;
+    }
     E.cursor_x = saved_cx;
     E.cursor_y = saved_cy;
     E.coloffset = saved_coloff;
-    E.rowoffset = saved_rowoff;
+    E.rowoffset = saved_rowoff > 0 ? saved_rowoff : 0;
   }
 }
 
 /*** append buffer ***/
-struct abuf {
-  char *b;
-  int len;
-};
-
-
 //set empty buffer
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 
-//continuously append strings to buffer so writes are not scattered
+//continuously append strings to buffer so writes are not scattered; the
+//capacity doubles, so a buffer that is reused stops allocating
 void abAppend(struct abuf *ab, const char *s, int len) {
-  //allocate for curr string + appended component
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL) 
-    return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) 
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
@@ -746,6 +5422,353 @@ void abFree(struct abuf *ab) {
   free(ab->b);
 }
 
+/*** screen ***/
+//frames are drawn into the back grid and compared with the front one, so
+//only cells that changed are sent, each reached by the shortest cursor
+//motion and with only the attributes that differ switched
+
+//SGR sequence taking the terminal from attributes a (ATTR_UNKNOWN when
+//not known) to b, built once rather than formatted per cell
+char sgrtable[ATTR_STATES + 1][ATTR_STATES][12];
+unsigned char sgrlen[ATTR_STATES + 1][ATTR_STATES];
+
+void editorScreenInitSgr() {
+  for (int a = 0; a <= ATTR_STATES; a++)
+    for (int b = 0; b < ATTR_STATES; b++) {
+      char *s = sgrtable[a][b];
+      int len = 0;
+      if (b == 0 && a != 0) {
+        len = snprintf(s, 12, "\x1b[m");
+      } else if (a != b) {
+        len = snprintf(s, 12, "\x1b[");
+        if (a == ATTR_UNKNOWN || (a & ATTR_REVERSE) != (b & ATTR_REVERSE))
+          len += snprintf(s + len, 12 - len, (b & ATTR_REVERSE) ? "7;" : "27;");
+        if (a == ATTR_UNKNOWN || ATTR_FG(a) != ATTR_FG(b))
+          len += snprintf(s + len, 12 - len, "%d;",
+                          ATTR_FG(b) ? 30 + ATTR_FG(b) : 39);
+        s[len - 1] = 'm';
+      }
+      sgrlen[a][b] = len;
+    }
+}
+
+//start a frame with every cell blank, resizing the grids (and forgetting
+//what the terminal shows) when the window changed
+void editorScreenBegin() {
+  struct editorScreen *s = &E.screen;
+  int rows = E.screen_rows + 2;
+  if (rows != s->rows || E.screen_cols != s->cols || s->back == NULL) {
+    if (s->back == NULL) editorScreenInitSgr();
+    s->rows = rows;
+    s->cols = E.screen_cols;
+    s->front = realloc(s->front, rows * s->cols);
+    s->back = realloc(s->back, rows * s->cols);
+    s->front_attr = realloc(s->front_attr, rows * s->cols);
+    s->back_attr = realloc(s->back_attr, rows * s->cols);
+    s->valid = 0;
+  }
+  memset(s->back, ' ', s->rows * s->cols);
+  memset(s->back_attr, 0, s->rows * s->cols);
+}
+
+//draw len bytes at row y, column x of the frame in one attribute,
+//clipped to the screen
+void editorScreenPut(int y, int x, const char *text, int len, int attr) {
+  struct editorScreen *s = &E.screen;
+  if (y < 0 || y >= s->rows || x >= s->cols) return;
+  if (len > s->cols - x) len = s->cols - x;
+  memcpy(&s->back[y * s->cols + x], text, len);
+  memset(&s->back_attr[y * s->cols + x], attr, len);
+}
+
+void editorScreenFill(int y, int x, int n, char ch, int attr) {
+  struct editorScreen *s = &E.screen;
+  if (y < 0 || y >= s->rows || x >= s->cols) return;
+  if (n > s->cols - x) n = s->cols - x;
+  memset(&s->back[y * s->cols + x], ch, n);
+  memset(&s->back_attr[y * s->cols + x], attr, n);
+}
+
+//switch the terminal to attributes attr, changing only what differs
+void editorScreenAttr(struct abuf *ab, int attr) {
+  struct editorScreen *s = &E.screen;
+  if (s->attr == attr) return;
+  int from = s->attr == -1 ? ATTR_UNKNOWN : s->attr;
+  abAppend(ab, sgrtable[from][attr], sgrlen[from][attr]);
+  s->attr = attr;
+}
+
+//ESC [ n ; m final, or with a single parameter when m is -1, and none at
+//all when n is 1 for the relative motions
+int editorScreenCsi(char *buf, int n, int m, char final) {
+  int len = 0;
+  buf[len++] = '\x1b';
+  buf[len++] = '[';
+  int args[2] = {n, m};
+  for (int i = 0; i < 2 && args[i] != -1; i++) {
+    if (i) buf[len++] = ';';
+    if (args[i] == 1 && m == -1) break;
+    char digits[12];
+    int nd = 0;
+    for (int v = args[i]; v || !nd; v /= 10) digits[nd++] = '0' + v % 10;
+    while (nd) buf[len++] = digits[--nd];
+  }
+  buf[len++] = final;
+  return len;
+}
+
+//move the terminal cursor to row y, column x by the shortest sequence:
+//absolute, relative along a row or column, or carriage return and newline
+void editorScreenMove(struct abuf *ab, int y, int x) {
+  struct editorScreen *s = &E.screen;
+  if (s->cy == y && s->cx == x) return;
+  char best[32];
+  char buf[32];
+  int len = editorScreenCsi(best, y + 1, x + 1, 'H');
+  int n = -1;
+  if (s->cy == y && s->cx != -1) {
+    if (x == 0) {
+      buf[0] = '\r';
+      n = 1;
+    } else if (x == s->cx - 1) {
+      buf[0] = '\b';
+      n = 1;
+    } else {
+      n = x > s->cx ? editorScreenCsi(buf, x - s->cx, -1, 'C') :
+                      editorScreenCsi(buf, s->cx - x, -1, 'D');
+    }
+  } else if (s->cx == x && s->cy != -1) {
+    n = y > s->cy ? editorScreenCsi(buf, y - s->cy, -1, 'B') :
+                    editorScreenCsi(buf, s->cy - y, -1, 'A');
+  } else if (x == 0 && y == s->cy + 1 && s->cy != -1) {
+    memcpy(buf, "\r\n", 2);
+    n = 2;
+  }
+  if (n != -1 && n < len) abAppend(ab, buf, n);
+  else abAppend(ab, best, len);
+  s->cy = y;
+  s->cx = x;
+}
+
+//write cells [x, x + n) of row y, all in one attribute, at the cursor,
+//which then sits past them; past the last column the terminal's idea of
+//it is not to be trusted
+void editorScreenEmit(struct abuf *ab, int y, int x, int n) {
+  struct editorScreen *s = &E.screen;
+  editorScreenAttr(ab, s->back_attr[y * s->cols + x]);
+  abAppend(ab, &s->back[y * s->cols + x], n);
+  s->cx += n;
+  if (s->cx == s->cols) {
+    s->cx = -1;
+    s->cy = -1;
+  }
+}
+
+//cells of row y from x on that share x's attribute, up to end
+int editorScreenRun(int y, int x, int end) {
+  struct editorScreen *s = &E.screen;
+  const unsigned char *a = &s->back_attr[y * s->cols];
+  int k = x + 1;
+  while (k < end && a[k] == a[x]) k++;
+  return k - x;
+}
+
+//when the change to row y is text shifted right (a typed character) or
+//left (a deleted one) from some column on, have the terminal shift it with
+//ICH or DCH and update the front row to match, so only the new cells are
+//left to write
+void editorScreenShiftRow(struct abuf *ab, int y) {
+  struct editorScreen *s = &E.screen;
+  char *b = &s->back[y * s->cols];
+  char *f = &s->front[y * s->cols];
+  unsigned char *ba = &s->back_attr[y * s->cols];
+  unsigned char *fa = &s->front_attr[y * s->cols];
+  int x0 = 0;
+  while (x0 < s->cols && b[x0] == f[x0] && ba[x0] == fa[x0]) x0++;
+  int x1 = s->cols - 1;
+  while (x1 > x0 && b[x1] == f[x1] && ba[x1] == fa[x1]) x1--;
+  if (x1 - x0 < 8) return;
+  for (int k = 1; k <= 4; k++) {
+    int n = x1 - x0 + 1 - k;
+    int ins = !memcmp(&b[x0 + k], &f[x0], n) && !memcmp(&ba[x0 + k], &fa[x0], n);
+    int del = !ins && !memcmp(&b[x0], &f[x0 + k], n) &&
+              !memcmp(&ba[x0], &fa[x0 + k], n);
+    if (!ins && !del) continue;
+    char buf[16];
+    int len = editorScreenCsi(buf, k, -1, ins ? '@' : 'P');
+    //blanks DCH brings in take the current attributes, keep them plain
+    editorScreenMove(ab, y, x0);
+    if (del) editorScreenAttr(ab, 0);
+    abAppend(ab, buf, len);
+    if (ins) {
+      memmove(&f[x0 + k], &f[x0], s->cols - x0 - k);
+      memmove(&fa[x0 + k], &fa[x0], s->cols - x0 - k);
+    } else {
+      memmove(&f[x0], &f[x0 + k], s->cols - x0 - k);
+      memmove(&fa[x0], &fa[x0 + k], s->cols - x0 - k);
+      x0 = s->cols - k;
+    }
+    //cells ICH opens up are about to be written over
+    memset(&f[x0], ' ', k);
+    memset(&fa[x0], ins ? 0xff : 0, k);
+    return;
+  }
+}
+
+//whether n bytes are all ASCII, eight at a time
+int editorScreenAscii(const char *p, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    unsigned long long w;
+    memcpy(&w, p + i, 8);
+    if (w & 0x8080808080808080ULL) return 0;
+  }
+  for (; i < n; i++)
+    if (p[i] & 0x80) return 0;
+  return 1;
+}
+
+//one row of the diff: runs of changed cells are written a run of one
+//attribute at a time, short runs of unchanged ones in between are
+//rewritten when that is cheaper than moving past them, and a changed
+//blank tail is erased. Bytes past ASCII may not take one column each, so
+//rows holding them are redrawn whole
+void editorScreenDiffRow(struct abuf *ab, int y) {
+  struct editorScreen *s = &E.screen;
+  const char *b = &s->back[y * s->cols];
+  const char *f = &s->front[y * s->cols];
+  const unsigned char *ba = &s->back_attr[y * s->cols];
+  const unsigned char *fa = &s->front_attr[y * s->cols];
+  int tail = s->cols;
+  while (tail > 0 && b[tail - 1] == ' ' && ba[tail - 1] == 0) tail--;
+  int whole = !editorScreenAscii(b, s->cols) || !editorScreenAscii(f, s->cols);
+  if (!whole) editorScreenShiftRow(ab, y);
+
+  int changed_tail = 0;
+  for (int x = tail; x < s->cols; x++)
+    changed_tail += b[x] != f[x] || ba[x] != fa[x];
+
+  int x = 0;
+  if (whole) {
+    editorScreenMove(ab, y, 0);
+    while (x < tail) {
+      int n = editorScreenRun(y, x, tail);
+      editorScreenEmit(ab, y, x, n);
+      x += n;
+    }
+    s->cx = -1;
+    s->cy = -1;
+  }
+  while (x < s->cols) {
+    if (!whole && b[x] == f[x] && ba[x] == fa[x]) {
+      x++;
+      continue;
+    }
+    if (x >= tail && (changed_tail > 2 || whole)) {
+      editorScreenMove(ab, y, x);
+      editorScreenAttr(ab, 0);
+      abAppend(ab, "\x1b[K", 3);
+      break;
+    }
+    if (s->cy == y && s->cx != -1 && x > s->cx && x - s->cx <= 3 &&
+        editorScreenRun(y, s->cx, x) == x - s->cx &&
+        ba[s->cx] == s->attr)
+      editorScreenEmit(ab, y, s->cx, x - s->cx);
+    //the changed run: cells up to the next unchanged one, cut at an
+    //attribute change
+    int end = x + 1;
+    while (end < tail && (b[end] != f[end] || ba[end] != fa[end])) end++;
+    int n = editorScreenRun(y, x, end);
+    editorScreenMove(ab, y, x);
+    editorScreenEmit(ab, y, x, n);
+    x += n;
+  }
+}
+
+//append what turns the terminal's screen into the frame, leaving the
+//cursor at row cy, column cx; the back grid becomes the front one
+//the text rows moved up by d rows (down when d is negative): have the
+//terminal scroll them inside a region that leaves the status and message
+//bars alone, and shift the front grid to match, so only the rows scrolled
+//into view differ
+void editorScreenScroll(struct abuf *ab, int d) {
+  struct editorScreen *s = &E.screen;
+  int text = s->rows - 2;
+  int n = d > 0 ? d : -d;
+  int keep = (text - n) * s->cols;
+  char buf[32];
+  editorScreenAttr(ab, 0);
+  abAppend(ab, buf, editorScreenCsi(buf, 1, text, 'r'));
+  abAppend(ab, buf, editorScreenCsi(buf, n, -1, d > 0 ? 'S' : 'T'));
+  abAppend(ab, "\x1b[r", 3);
+  //setting the region homes the cursor
+  s->cy = 0;
+  s->cx = 0;
+
+  int from = d > 0 ? n * s->cols : 0;
+  int to = d > 0 ? 0 : n * s->cols;
+  int blank = d > 0 ? keep : 0;
+  memmove(&s->front[to], &s->front[from], keep);
+  memmove(&s->front_attr[to], &s->front_attr[from], keep);
+  memset(&s->front[blank], ' ', n * s->cols);
+  memset(&s->front_attr[blank], 0, n * s->cols);
+}
+
+//send the frame as the changes from the last one, scrolling the text rows
+//by scroll rows first
+void editorScreenFlush(struct abuf *ab, int cy, int cx, int scroll) {
+  struct editorScreen *s = &E.screen;
+  int size = s->rows * s->cols;
+  int changed = !s->valid || scroll ? 2 : 0;
+  for (int y = 0; y < s->rows && changed < 2; y++) {
+    int at = y * s->cols;
+    changed += memcmp(&s->back[at], &s->front[at], s->cols) ||
+               memcmp(&s->back_attr[at], &s->front_attr[at], s->cols);
+  }
+  //hide the cursor while it jumps across rows, and have the terminal show
+  //the whole frame at once where it can
+  if (changed > 1) {
+    if (s->sync) abAppend(ab, "\x1b[?2026h", 8);
+    abAppend(ab, "\x1b[?25l", 6);
+  }
+  if (!s->valid) {
+    abAppend(ab, "\x1b[m\x1b[H\x1b[2J", 10);
+    memset(s->front, ' ', size);
+    memset(s->front_attr, 0, size);
+    s->cy = 0;
+    s->cx = 0;
+    s->attr = 0;
+    s->valid = 1;
+  } else if (scroll) {
+    editorScreenScroll(ab, scroll);
+  }
+  for (int y = 0; y < s->rows; y++) {
+    int at = y * s->cols;
+    if (memcmp(&s->back[at], &s->front[at], s->cols) ||
+        memcmp(&s->back_attr[at], &s->front_attr[at], s->cols))
+      editorScreenDiffRow(ab, y);
+  }
+  editorScreenMove(ab, cy, cx);
+  if (changed > 1) {
+    abAppend(ab, "\x1b[?25h", 6);
+    if (s->sync) abAppend(ab, "\x1b[?2026l", 8);
+  }
+  memcpy(s->front, s->back, size);
+  memcpy(s->front_attr, s->back_attr, size);
+}
+
+//write the whole frame with as few calls as the terminal accepts, one
+//when it takes it all
+void editorScreenWrite(const char *buf, int len) {
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, buf, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return;
+    buf += n;
+    len -= n;
+  }
+}
+
 //displays prompt and allows for user input (incremental search added, NULL default)
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) { 
   size_t bufsize = 128;
@@ -786,6 +5809,21 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       buf[buflen] = '\0';
     }
 
+    //pasted text is typed in, up to its first line break
+    else if (c == PASTE) {
+      for (size_t i = 0; i < E.input.pastelen; i++) {
+        unsigned char p = E.input.paste[i];
+        if (p == '\r' || p == '\n') break;
+        if (iscntrl(p) || p >= 128) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = p;
+        buf[buflen] = '\0';
+      }
+    }
+
 
   if (callback) callback(buf, c);
 
@@ -796,7 +5834,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 //wasd movement to move cursor
 void editorMoveCursor(int key) {
   //prevent user from scrolling past current line end
-  erow *row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+  erow *row = editorRowAt(E.cursor_y);
   switch (key) {
     case ARROW_LEFT:
       if(E.cursor_x != 0) {
@@ -805,7 +5843,7 @@ void editorMoveCursor(int key) {
       //move to end of previous line 
       else if (E.cursor_y > 0) {
         E.cursor_y--;
-        E.cursor_x = E.row[E.cursor_y].size;
+        E.cursor_x = editorRowAt(E.cursor_y)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -830,13 +5868,27 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+  row = editorRowAt(E.cursor_y);
   int rowlen = row ? row->size : 0;
   if (E.cursor_x > rowlen) {
     E.cursor_x = rowlen;
   }
 }
 
+//jump to a line number typed at a prompt
+void editorGotoLine() {
+  char *query = editorPrompt("Go to line: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  long long line = atoll(query) - 1;
+  free(query);
+  if (line < 0) line = 0;
+  if (E.large.on)
+    editorLargeGoto(line);
+  else
+    E.cursor_y = line < E.numrows ? line : E.numrows;
+  E.cursor_x = 0;
+}
+
 //handles processing for read in character
 void editorProcessKeypress() {
   static int quit_times = EDITOR_QUIT_TIMES;
@@ -849,12 +5901,16 @@ void editorProcessKeypress() {
       break;
 
     case CTRL_KEY('q'):
+    //let a save in progress finish first
+    editorSaveCollect(1);
     if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
+    //leaving on purpose, unsaved edits included, so no journal is kept
+      editorSwapStop(0);
     //clear screen
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
@@ -865,17 +5921,28 @@ void editorProcessKeypress() {
       editorSave();
       break;
 
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     case HOME_KEY:
       E.cursor_x = 0;
       break;
     case END_KEY:
       if (E.cursor_y < E.numrows)
-        E.cursor_x = E.row[E.cursor_y].size;
+        E.cursor_x = editorRowAt(E.cursor_y)->size;
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
+
+    case CTRL_KEY('g'):
+      editorGotoLine();
+      break;
     
     case BACKSPACE:
     case CTRL_KEY('h'):
@@ -889,6 +5956,9 @@ void editorProcessKeypress() {
     case PAGE_UP:
     case PAGE_DOWN:
       {
+        //keys queued together are handled before the next frame, bring
+        //the viewport up to date with the cursor as drawing would
+        editorScroll();
         if (c == PAGE_UP) {
           E.cursor_y = E.rowoffset;
         } else if (c == PAGE_DOWN) {
@@ -909,9 +5979,17 @@ void editorProcessKeypress() {
       editorMoveCursor(c);
       break;
     
+    //repaint the whole screen, in case something else drew on it
     case CTRL_KEY('l'):
+      E.screen.valid = 0;
+      break;
+
     case '\x1b':
       break;
+
+    case PASTE:
+      editorInsertPaste(E.input.paste, E.input.pastelen);
+      break;
     
     default: 
       editorInsertChar(c);
@@ -919,13 +5997,14 @@ void editorProcessKeypress() {
   }
 
   quit_times = EDITOR_QUIT_TIMES;
+  editorLargeFollow();
 }
 
 //keep cursor within window when user scrolls 
 void editorScroll() {
   E.rx = 0; 
   if (E.cursor_y < E.numrows) {
-    E.rx = editorRowCursor_xToRx(&E.row[E.cursor_y], E.cursor_x);
+    E.rx = editorRowCursor_xToRx(editorRowAt(E.cursor_y), E.cursor_x);
   }
   if (E.cursor_y < E.rowoffset) {
     E.rowoffset = E.cursor_y;
@@ -941,145 +6020,181 @@ void editorScroll() {
   }
 }
 
+//highlight the rows on screen plus a margin above and below, rows outside
+//stay unhighlighted until they scroll near; stale rows go to the workers
+//and are drawn plain until their results are collected
+void editorHighlightViewport() {
+  editorHighlightCollect();
+  int first = E.rowoffset - HL_PREFETCH_ROWS;
+  if (first < 0) first = 0;
+  int last = E.rowoffset + E.screen_rows + HL_PREFETCH_ROWS;
+  if (last > E.numrows) last = E.numrows;
+  if (first >= last) return;
+  //every row up to last gets its start state, stale ones from a scan
+  editorSyntaxScanTo(last);
+  rowiter it;
+  erow *row;
+  int at = first;
+  for (row = editorRowIterStart(&it, first); row && at < last;
+       row = editorRowIterNext(&it), at++) {
+    editorRowRender(row);
+    if (E.hlpool.nworkers == 0 && row->hl_epoch != E.hl_epoch)
+      editorUpdateSyntax(row, row->hl_in);
+  }
+  if (E.hlpool.nworkers)
+    editorHighlightSubmit(first, last);
+}
+
 //mark all rows with ~
-void editorMarkRows(struct abuf *ab) {
+void editorMarkRows() {
+  static int *spans = NULL;
+  static int spancap = 0;
+  editorHighlightViewport();
   int r;
   for (r = 0; r < E.screen_rows; r++) {
     int filerow = r + E.rowoffset; 
     //check to see if we are drawing row that's part of the text buffer or row after text buffer end
     if(filerow >= E.numrows) {
+      //a large file's window can end before the file does: no ~ there,
+      //only a note on the first row after it
+    if (E.large.on && E.large.end < E.maplen) {
+      static const char edge[] = "-- more of the file after this, not loaded --";
+      if (filerow == E.numrows)
+        editorScreenPut(r, 0, edge, sizeof(edge) - 1, ATTR_REVERSE);
+    }
       //only have welcome message show up if file read in is empty
-    if (E.numrows == 0 && r == E.screen_rows / 3) {
+    else if (E.numrows == 0 && r == E.screen_rows / 3) {
       char welcome[80];
       int welcomelen = snprintf(welcome, sizeof(welcome),
         "Lite Editor -- version %s", EDITOR_VERSION);
       if (welcomelen > E.screen_cols) welcomelen = E.screen_cols;
       //centering welcome header 
       int padding = (E.screen_cols - welcomelen) / 2;
-      if (padding) {
-        abAppend(ab, "~", 1);
-        padding--;
-      }
-      while (padding--) 
-        abAppend(ab, " ", 1);
-      abAppend(ab, welcome, welcomelen);
+      if (padding) 
+        editorScreenPut(r, 0, "~", 1, 0);
+      editorScreenPut(r, padding, welcome, welcomelen, 0);
     } 
     else {
-      abAppend(ab, "~", 1);
+      editorScreenPut(r, 0, "~", 1, 0);
     }
     }
     else{
-      int len = E.row[filerow].rsize - E.coloffset;
+      erow *row = editorRowAt(filerow);
+      //render starts at column rstart, long rows only hold a slice
+      int len = row->rstart + row->rsize - E.coloffset;
       if (len < 0) len = 0;
       if(len > E.screen_cols) 
         len = E.screen_cols; 
     
     //syntax highlight
-     char *c = &E.row[filerow].render[E.coloffset];
-     unsigned char *hl = &E.row[filerow].hl[E.coloffset];
-     int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
+     int off = E.coloffset - row->rstart;
+     char *c = &row->render[off];
+     //rows still waiting on a worker are drawn plain
+     unsigned char *hl = row->hl_epoch == E.hl_epoch ? &row->hl[off] : NULL;
+     //search matches are laid over hl while drawing, hl itself is untouched
+     int nspans = editorSearchSpans(filerow, row, &spans, &spancap);
+     int m = 0;
+      int j = 0;
+      //runs of one colour go to the frame in a single copy
+      while (j < len) {
+        int k = j;
+        int run_attr = -1;
+        for (; k < len; k++) {
+          int cls = hl ? HL_CLASS(hl[k]) : HL_NORMAL;
+          while (m < nspans && spans[2 * m + 1] <= E.coloffset + k) m++;
+          if (m < nspans && spans[2 * m] <= E.coloffset + k) cls = HL_MATCH;
+          int attr = iscntrl(c[k]) ? -1 :
+                     cls == HL_NORMAL ? 0 : editorSyntaxToColor(cls) - 30;
+          if (run_attr == -1 && k == j) run_attr = attr;
+          if (attr != run_attr || attr == -1) break;
+        }
+        if (k > j) {
+          editorScreenPut(r, j, &c[j], k - j, run_attr);
+          j = k;
+        } else {
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-          abAppend(ab, "\x1b[39m", 5);
-          current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } 
-        else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-          char buf[16];
-          int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-          abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          editorScreenPut(r, j, &sym, 1, ATTR_REVERSE);
+          j++;
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-
-    //erase line to right of cursor
-    abAppend(ab, "\x1b[K", 3);
-
-    abAppend(ab, "\r\n", 2);
     }
 }
 
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+  int y = E.screen_rows;
   //printing out name of file
   char status[80];
   //have file line count align to right screen end
   char rstatus[80];
+  char lines[32];
+  editorLineCount(lines, sizeof(lines));
+  long long line = editorFirstLine() + E.cursor_y + 1;
   //show if editor has unsaved changes or not 
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[No Name]", E.numrows,
+  int len = snprintf(status, sizeof(status), "%.20s - %s lines %s",
+    E.filename ? E.filename : "[No Name]", lines,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cursor_y + 1, E.numrows);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %lld/%s",
+    E.syntax ? E.syntax->filetype : "no ft", line, lines);
+  searchlevel *lv = editorSearchShown();
+  if (lv && lv->total)
+    rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d | %s | %lld/%s",
+      E.search.current + 1, lv->total, E.syntax ? E.syntax->filetype : "no ft",
+      line, lines);
+  else if (lv)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s | %lld/%s",
+      E.search.pat.error ? E.search.pat.error : "no matches",
+      E.syntax ? E.syntax->filetype : "no ft", line, lines);
   if (len > E.screen_cols) len = E.screen_cols;
-  abAppend(ab, status, len);
-  while (len < E.screen_cols) {
-    if (E.screen_cols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } 
-    else {
-    abAppend(ab, " ", 1);
-    len++;
-  }
-  }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  editorScreenFill(y, 0, E.screen_cols, ' ', ATTR_REVERSE);
+  editorScreenPut(y, 0, status, len, ATTR_REVERSE);
+  if (E.screen_cols - len >= rlen)
+    editorScreenPut(y, E.screen_cols - rlen, rstatus, rlen, ATTR_REVERSE);
 }
 
 //show status message for 5 seconds 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screen_cols) msglen = E.screen_cols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    editorScreenPut(E.screen_rows + 1, 0, E.statusmsg, msglen, 0);
 }
 
 //VT100 escape sequence https://vt100.net/docs/vt100-ug/chapter3.html 
 
-void editorRefreshScreen() {
+//build the next frame, timing it; returns the bytes to send
+struct abuf *editorBuildFrame() {
+  double start = editorNowMs();
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
-  //hide cursor during screen refresh
-  abAppend(&ab, "\x1b[?25l", 6);
-  //escape sequence + H = positions cursor at first row and column of cleared terminal 
-  abAppend(&ab, "\x1b[H", 3);
-
-  editorMarkRows(&ab); 
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.rowoffset) + 1, (E.rx - E.coloffset) + 1);
-  abAppend(&ab, buf, strlen(buf));
-
-  //unhide cursor
-  abAppend(&ab, "\x1b[?25h", 6);
+  editorScreenBegin();
+  editorMarkRows(); 
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
+  //only the cells that differ from the last frame are written, built in
+  //the frame buffer kept across frames and sent with one write
+  struct abuf *ab = &E.screen.frame;
+  ab->len = 0;
+  //a viewport that only moved vertically, by less than a screen, is
+  //scrolled by the terminal
+  struct editorScreen *s = &E.screen;
+  int scroll = E.rowoffset - s->rowoffset;
+  if (E.coloffset != s->coloffset || scroll >= E.screen_rows ||
+      -scroll >= E.screen_rows)
+    scroll = 0;
+  editorScreenFlush(ab, E.cursor_y - E.rowoffset, E.rx - E.coloffset, scroll);
+  s->rowoffset = E.rowoffset;
+  s->coloffset = E.coloffset;
+  E.screen.build_ms = editorNowMs() - start;
+  E.screen.bytes = ab->len;
+  return ab;
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+void editorRefreshScreen() {
+  struct abuf *ab = editorBuildFrame();
+  editorScreenWrite(ab->b, ab->len);
 }
 
 //sets the status message 
@@ -1089,47 +6204,92 @@ void editorSetStatusMessage(const char *fmt, ...) {
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
   E.statusmsg_time = time(NULL);
+  //redraw once the message is old enough to be hidden, a little after so
+  //time(), which reads a coarse clock, agrees
+  if (E.timerfd != -1) {
+    struct itimerspec t = { { 0, 0 }, { E.statusmsg_time + 5, 50000000 } };
+    timerfd_settime(E.timerfd, TFD_TIMER_ABSTIME, &t, NULL);
+  }
 }
 
 
 /****init  ******/
-void initEditor() {
+//editor state without touching the terminal
+void initEditorState() {
   E.cursor_x = 0; 
   E.cursor_y = 0; 
   E.rx = 0; 
   E.rowoffset = 0; 
   E.coloffset = 0;
   E.numrows = 0; 
-  E.row = NULL; 
+  E.rows = rowNodeNew(1); 
   E.dirty = 0;
   E.filename = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.add = NULL;
+  E.addpin = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.sigfd = E.timerfd = E.wakefd = -1;
   E.syntax = NULL;
+  E.hl_epoch = 1;
+  E.hl_frontier = 0;
+  pthread_mutex_init(&E.saving.lock, NULL);
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.max = getenv("LITE_UNDO_MAX") ? strtoul(getenv("LITE_UNDO_MAX"), NULL, 10)
+                                        : UNDO_MAX_BYTES;
+  editorInitSyntaxTables();
+}
+
+void initEditor() {
+  initEditorState();
+  editorEventsStart();
+  editorHighlightPoolStart();
   if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) 
     die("getWindowSize error");
   //dont draw line at bottom of screen (leave space for status bar and status message)
   E.screen_rows -= 2;
+  editorSyncProbe();
 }
 
 
+//tests.c and bench.c bring in the editor with their own main
+#ifndef LITE_NO_MAIN
 int main(int argc, char *argv[]) {
   enableRawMode();
   initEditor(); 
 
+  //initialize a status message that shows up for 5 seconds or until first trigger of user input 
+   editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = go to line | Ctrl-Z/Y = undo/redo");
+
   if (argc >= 2) {
     editorOpen(argv[1]);
+    struct editorOpenStats *st = &E.openstats;
+    editorSetStatusMessage("%s %d lines in %.1f ms (map %.1f, index %.1f, rows %.1f)",
+      st->mapped ? "Mapped" : "Read", E.numrows, st->total_ms,
+      st->map_ms, st->index_ms, st->rows_ms);
+    if (E.large.on)
+      editorSetStatusMessage("Large file: %d lines loaded in %.1f ms, the rest is read as needed",
+        E.numrows, st->total_ms);
+    if (E.swap.recovered)
+      editorSetStatusMessage("Recovered %d unsaved edits from %s",
+        E.swap.recovered, E.swap.path);
+    if (E.swap.aside)
+      editorSetStatusMessage("A journal that can't be replayed onto the file was kept as %s.%d",
+        E.swap.path, E.swap.aside);
   }
 
-  //initialize a status message that shows up for 5 seconds or until first trigger of user input 
-   editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
   while (1) {
     editorRefreshScreen();
-    editorProcessKeypress();
+    //keys already typed are all handled before the next frame is drawn
+    do {
+      editorProcessKeypress();
+    } while (editorInputPending());
   }
 
 
 
   return 0;
-}
\ No newline at end of file
+}
+#endif